@@ -0,0 +1,26 @@
+#!/bin/bash
+#
+# bench_startup.sh - Compare the startup latency of "tsh -c" against
+# /bin/sh -c and bash -c by launching /bin/true many times in a row.
+#
+# usage: ./bench_startup.sh [runs]
+#
+RUNS=${1:-1000}
+CMD=/bin/true
+
+bench() {
+    local start end
+    start=$(date +%s%N)
+    for ((i = 0; i < RUNS; i++)); do
+        "$@" $CMD
+    done
+    end=$(date +%s%N)
+    printf "%-12s %8d us/run\n" "$1" $(((end - start) / RUNS / 1000))
+}
+
+echo "Startup latency over $RUNS runs of '$CMD'"
+bench ./tsh -c
+bench /bin/sh -c
+if command -v bash > /dev/null; then
+    bench bash -c
+fi
@@ -4,6 +4,7 @@
  * Seung Heon Shin Brian (shs522) & Navya Suri (ns3774)
  * shs522+ns3774
  */
+#define _GNU_SOURCE /* for prlimit */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,12 +14,45 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <sys/mman.h>
 
 /* Misc manifest constants */
 #define MAXLINE 1024   /* max line size */
 #define MAXARGS 128    /* max args on a command line */
 #define MAXJOBS 16     /* max jobs at any point in time */
 #define MAXJID 1 << 16 /* max job ID */
+#define MAXCMDS 32     /* max commands in a command list */
+#define ENVSLOTS 64    /* initial slots in the environment table */
+#define MAXPATH 256    /* max length of a cgroup path */
+#define MAXEVENTS 64   /* job stops and exits remembered for wait */
+#define MAXNAME 32     /* max length of a coprocess name */
+#define RECBUF 65536   /* bytes of session log buffered before a write */
+#define STATEMAX (4 * MAXJOBS) /* state file records before it is compacted */
+#define MEMOMAX (64 << 20)     /* bytes kept in the memo cache */
+#define MEMOMAGIC "TSHM1"      /* first word of a memo cache entry */
+#define GOVTICK 1000000000ull  /* ns between two looks at the system pressure */
+#define MAXSCRIPTS 16          /* sourced files kept parsed */
+#define MAXDEPTH 8             /* max nesting of source commands */
+#define HISTTAIL 1024          /* history entries !prefix scans beyond the saved tree */
+#define KILLSET 256            /* slots of a kill target set, a power of two > 2 * MAXARGS */
+
+/* Session log records: an 8-byte monotonic time in ns since the session
+ * started, a 2-byte payload length, a type and an argument, then the
+ * payload. Fields are in host byte order. */
+#define RECHDR 12         /* bytes in a record header */
+#define RECMAGIC "TSHR1\n" /* first bytes of a session log */
+#define REC_INPUT 1       /* a command line; payload is the line */
+#define REC_DONE 2        /* the command line finished evaluating */
+#define REC_SIGNAL 3      /* a forwarded signal; argument is its number */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -36,12 +70,77 @@
  * At most 1 job can be in the FG state.
  */
 
+/* Operators that join a command to the next one in a command list */
+#define OP_END 0 /* last command of the list */
+#define OP_SEQ 1 /* ;  - always run the next command */
+#define OP_AND 2 /* && - run the next command if this one succeeded */
+#define OP_OR 3  /* || - run the next command if this one failed */
+
 /* Global variables */
 extern char **environ;   /* defined in libc */
 char prompt[] = "tsh> "; /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;         /* if true, print additional output */
 int nextjid = 1;         /* next job ID to allocate */
 char sbuf[MAXLINE];      /* for composing sprintf messages */
+int last_status = 0;     /* exit status of the last foreground job */
+int fg_interrupted = 0;  /* last foreground job was killed or stopped by a signal */
+int subshell = 0;        /* true in the child that runs a background list */
+int int_pending = 0;     /* ctrl-c arrived while there was no foreground job */
+int nints = 0;           /* ctrl-c presses so far */
+
+int recfd = -1;          /* session log being recorded, -1 if none */
+pid_t recpid;            /* the shell that owns recfd (not its children) */
+char recbuf[RECBUF];     /* records not yet written to recfd */
+int reclen = 0;          /* bytes used in recbuf */
+struct timespec recstart; /* when recording or replaying started */
+
+char *rpsigs = NULL;     /* next signal record to replay, NULL if none */
+char *rpend;             /* end of the command's signal records */
+uint64_t rpbase;         /* recorded start time of the replayed command */
+struct timespec rpstart; /* when the replayed command started */
+
+int statefd = -1;        /* job state log, -1 if none */
+char statepath[MAXPATH]; /* path of the job state log */
+int staterecs = 0;       /* records in the state log since it was compacted */
+
+int memofd[2] = {-1, -1}; /* capture files for the stdout and stderr of a memo job */
+int memohits = 0;         /* memo commands answered from the cache */
+int memomisses = 0;       /* memo commands that had to run */
+int memoevictions = 0;    /* entries dropped to keep the cache under MEMOMAX */
+
+int govon = 0;            /* the load governor is enabled */
+double govhigh = 60;      /* pressure (%) above which background jobs are paused */
+double govlow = 30;       /* pressure (%) below which they are resumed */
+struct timespec govlast;  /* when the governor last looked at the pressure */
+int govpauses = 0;        /* jobs paused by the governor so far, to number the pauses */
+
+char srcwhere[MAXPATH + 16] = ""; /* "file:line: " of the sourced line being handled */
+int srcdepth = 0;                 /* source commands being run */
+unsigned long srcuses = 0;        /* source commands run so far, for the script cache */
+
+int histfd = -1;           /* command history, -1 if off */
+int histidxfd = -1;        /* offsets of the history lines */
+char *histmap = NULL;      /* the history as it was at startup */
+size_t histsize = 0;       /* bytes in histmap */
+uint64_t *histoff = NULL;  /* offset of each line of histmap */
+int nhist = 0;             /* lines in histmap */
+char **histnew = NULL;     /* lines added since startup */
+int nnew = 0;              /* lines in histnew */
+int capnew = 0;            /* slots in histnew */
+int *histtree = NULL;      /* prefix search tree over histmap, see hist_find */
+int histtreen = 0;         /* mapped entries covered by histtree */
+void *histtreemap = NULL;  /* the saved tree file, if histtree points into it */
+size_t histtreesize = 0;   /* bytes in histtreemap */
+char histtreepath[MAXPATH + 8]; /* file keeping histtree between sessions */
+
+struct cmdin_t
+{                      /* The buffered reader for command lines, see readcmd */
+    int fd;            /* where command lines are read from */
+    char buf[MAXLINE]; /* bytes read ahead of the current line */
+    int pos;           /* next unread byte of buf */
+    int len;           /* bytes in buf */
+};
+struct cmdin_t cmdin = {STDIN_FILENO, "", 0, 0};
 
 struct job_t
 {                          /* The job struct */
@@ -49,15 +148,109 @@ struct job_t
     int jid;               /* job ID [1, 2, ...] */
     int state;             /* UNDEF, BG, FG, or ST */
     char cmdline[MAXLINE]; /* command line */
+    char cgroup[MAXPATH];  /* the job's own cgroup directory, or "" */
+    unsigned long long start; /* process start time, in ticks since boot */
+    int adopted;           /* re-adopted from the state file, not our child */
+    int pidfd;             /* pidfd of an adopted job, or -1 */
+    int governed;          /* stopped by the load governor: its pause number, else 0 */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+
+struct jobevent_t
+{                /* A stop or exit reported by sigchld_handler */
+    pid_t pid;   /* job PID */
+    int jid;     /* its job ID, so %jid still finds it after it is reaped */
+    int status;  /* wait status */
+};
+struct jobevent_t events[MAXEVENTS]; /* ring of the latest job events */
+int nevents = 0;                     /* events recorded so far */
+
+struct coproc_t
+{                        /* A coprocess fed over a pair of pipes */
+    char name[MAXNAME];  /* name given to coproc, "" if the slot is free */
+    pid_t pid;           /* PID of the coprocess job */
+    int infd;            /* write end of the coprocess's stdin, -1 once closed */
+    int outfd;           /* read end of the coprocess's stdout */
+    int len;             /* bytes of unread output in buf */
+    char buf[MAXLINE];   /* output read ahead of the next recv */
+};
+struct coproc_t coprocs[MAXJOBS]; /* The coprocess list */
+
+struct memocap_t
+{                   /* The capture files of a memo job that was stopped */
+    pid_t pid;      /* PID of the job, 0 if the slot is free */
+    int fd[2];      /* its stdout and stderr capture files */
+    off_t shown[2]; /* bytes of each already copied to the terminal */
+};
+struct memocap_t memocaps[MAXJOBS]; /* Memo jobs whose output is still coming */
+
+struct limits_t
+{                  /* Resource limits applied to a job at launch */
+    rlim_t mem;    /* bytes of memory (RLIMIT_AS, memory.max) */
+    rlim_t cpu;    /* seconds of CPU time (RLIMIT_CPU) */
+    rlim_t nofile; /* open files (RLIMIT_NOFILE) */
+    rlim_t nproc;  /* processes (RLIMIT_NPROC, pids.max) */
+    double cpus;   /* share of one CPU (cpu.max), 0 if unlimited */
+};
+struct limits_t deflimits = {RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY, 0}; /* set by limit */
+struct limits_t joblimits;         /* limits for the job being launched */
+char cgroot[MAXPATH - 32];         /* parent directory of the job cgroups, "" if unusable */
+int cgready = 0;                   /* cgroot has been looked up */
+int cgnext = 0;                    /* sequence number for job cgroup names */
+
+struct env_t
+{                 /* The environment: every variable is exported */
+    char **slots; /* open-addressed "NAME=value" strings */
+    int size;     /* number of slots, a power of 2; 0 until first change */
+    int used;     /* slots holding a live or deleted entry */
+    int count;    /* live entries */
+    char **envp;  /* cached contiguous envp handed to execve */
+    int envcap;   /* capacity of envp */
+    int dirty;    /* envp must be rebuilt before its next use */
+};
+struct env_t env; /* The shell's environment */
+
+struct cmd_t
+{                  /* One command of a command list */
+    char **argv;   /* NULL-terminated argument list */
+    int op;        /* OP_END, OP_SEQ, OP_AND or OP_OR */
+    char *cmdline; /* text of the command, newline terminated */
+};
+
+struct cmdlist_t
+{                                     /* A parsed command line */
+    int ncmds;                        /* number of commands */
+    int bg;                           /* run the whole list in the background? */
+    struct cmd_t cmds[MAXCMDS];       /* the commands, in order */
+    char *argv[MAXARGS + MAXCMDS];    /* storage for the argv lists */
+    char args[MAXLINE];               /* storage for the arguments */
+    char text[MAXLINE + 2 * MAXCMDS]; /* storage for the command texts */
+};
+
+struct script_t
+{                          /* A sourced file, parsed once (see source_parse) */
+    char path[MAXPATH];    /* path given to source, "" if the slot is free */
+    dev_t dev;             /* identity of the file when it was parsed */
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *code;            /* the parsed commands */
+    size_t len;            /* bytes used in code */
+    int busy;              /* source commands running it right now */
+    unsigned long used;    /* srcuses when it was last run */
+};
+struct script_t scripts[MAXSCRIPTS]; /* The script cache */
 /* End global variables */
 
 /* Function prototypes */
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);     // Main routine that parses and interprets the command line
+void eval_list(struct cmdlist_t *list, char *cmdline, int exec_last); // Runs a parsed command line
+void eval_last(char *cmdline); // Runs the last line of a script
+int launch(char **argv, char *cmdline, int bg); // Forks and execs one program
 int builtin_cmd(char **argv); //Recognizes and interprets the built-in commands: quit, fg, bg, and jobs
+int isbuiltin(char *name);    // Returns true if name is a built-in command
 void do_bgfg(char **argv);    // Implements the bg and fg built-in commands
 void waitfg(pid_t pid);       // Waits for a foreground job to complete
 
@@ -79,6 +272,8 @@ struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid);
 int pid2jid(pid_t pid);
 void listjobs(struct job_t *jobs);
+void printjob(struct job_t *job);
+void setjobstate(struct job_t *job, int state);
 
 void usage(void);
 void unix_error(char *msg);
@@ -92,22 +287,131 @@ void _sigemptyset(sigset_t *set);
 void _sigaddset(sigset_t *set, int sig);
 void _sigprocmask(int sig, sigset_t *curSet, sigset_t *prevSet);
 pid_t _fork(void);
+void install_handlers(int interactive);
+int run_command(char *command);
+void exec_inplace(char **argv);
+int status2code(int status);
+int parselist(const char *cmdline, struct cmdlist_t *list);
+void do_export(char **argv);
+void do_unset(char **argv);
+void do_wait(char **argv);
+int waitjob(pid_t pid, sigset_t *prev);
+int jobevent(pid_t pid, int *status);
+pid_t eventpid(int jid);
+void do_coproc(char **argv);
+void do_send(char **argv);
+void do_recv(char **argv);
+struct coproc_t *getcoproc(char *name);
+void closecoproc(struct coproc_t *cp);
+void reap_coprocs(void);
+void do_kill(char **argv);
+int signum(char *name);
+int range_cmp(const void *a, const void *b);
+int killset_slot(int *set, int key);
+void do_disown(char **argv);
+
+unsigned int env_hash(const char *name, int len);
+void env_init(void);
+int env_lookup(const char *name, int len);
+void env_grow(void);
+void env_put(const char *assign);
+void env_unset(const char *name);
+char **env_envp(void);
+int isassign(const char *word);
+char **skipassign(char **argv);
+char *env_get(const char *name);
+
+void do_limit(char **argv);
+char **parselimits(char **argv, struct limits_t *lim);
+int haslimits(struct limits_t *lim);
+void apply_limits(struct limits_t *lim, char *cgroup);
+int cg_init(void);
+void cg_leave(void);
+int cg_write(char *dir, char *file, char *value);
+int cg_create(struct limits_t *lim, char *cgroup);
+void printusage(struct job_t *job);
+
+uint64_t elapsed(struct timespec *since);
+void rec_open(char *path);
+void rec_append(int type, int arg, const char *data, int len);
+void rec_flush(void);
+void replay(char *path, int fast);
+void replay_alarm(int sig);
+void replay_arm(void);
+char *loadlog(char *path, size_t *size);
+uint64_t recns(char *p);
+int recsize(char *p);
+void totrace(char *path);
+
+void state_open(char *path);
+void state_log(char op, struct job_t *job);
+void state_compact(void);
+unsigned long long proc_starttime(pid_t pid, char *state);
+int openpidfd(pid_t pid);
+void reap_adopted(void);
+void waitevent(sigset_t *prev);
+void waitinput(void);
+int readcmd(char *line, int size);
+
+void do_memo(char **argv);
+int memo_dir(char *dir);
+int memo_key(char **argv, char *path);
+uint64_t memo_hash(uint64_t h, const void *data, size_t len);
+int memo_replay(char *path);
+int memo_begin(void);
+void memo_end(char *path, int store);
+void reap_memos(void);
+int memo_copy(int from, int to, off_t len);
+int memo_evict(char *dir, off_t max);
+
+void do_govern(char **argv);
+void govern_tick(int force);
+double pressure(const char **source);
+
+void do_source(char **argv);
+struct script_t *getscript(char *path);
+int source_parse(struct script_t *sc, FILE *fp);
+char *source_next(char *code, struct cmdlist_t *list, int *line, char **cmdline);
+
+void hist_open(void);
+void hist_mapindex(int rebuild);
+char *hist_line(int n, int *len);
+void hist_add(char *cmdline);
+int hist_expand(char *cmdline);
+int hist_find(const char *prefix, int len);
+void hist_index(void);
+int hist_maptree(void);
+void hist_savetree(void);
+int hist_cmp(const void *a, const void *b);
+int hist_prefcmp(int n, const char *prefix, int len);
+void do_history(char **argv);
 
 /*
  * main - The shell's main routine
+ *
+ * With no operands the shell runs its interactive read/eval loop.
+ * "tsh -c cmdline" runs a single command line and "tsh script.tsh"
+ * runs the lines of a script file; in both cases the shell exits with
+ * the status of the last foreground job.
  */
 int main(int argc, char **argv)
 {
     char c;
     char cmdline[MAXLINE];
-    int emit_prompt = 1; /* emit prompt (default) */
-
-    /* Redirect stderr to stdout (so that driver will get all output
-     * on the pipe connected to stdout) */
-    dup2(1, 2);
+    int emit_prompt = 1;   /* emit prompt (default) */
+    char *command = NULL;  /* command line given with -c */
+    char *record = NULL;   /* session log to record with -R */
+    char *playback = NULL; /* session log to replay with -P */
+    char *statefile = NULL; /* job state log given with -S */
+    int fast = 0;          /* replay as fast as possible */
+    char next[MAXLINE];    /* the script line after cmdline */
+    int ahead = 0;         /* next holds a line read ahead */
+    int last;              /* cmdline is the script's last line */
+    int n;                 /* length of the line read */
+    int interactive;
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF)
+    while ((c = getopt(argc, argv, "hvpc:R:P:fT:S:")) != EOF)
     {
         switch (c)
         {
@@ -120,44 +424,134 @@ int main(int argc, char **argv)
         case 'p':            /* don't print a prompt */
             emit_prompt = 0; /* handy for automatic testing */
             break;
+        case 'c': /* run a single command line and exit */
+            command = optarg;
+            break;
+        case 'R': /* record the session */
+            record = optarg;
+            break;
+        case 'P': /* replay a recorded session */
+            playback = optarg;
+            break;
+        case 'f': /* replay without the recorded pauses */
+            fast = 1;
+            break;
+        case 'S': /* keep job state in a file across restarts */
+            statefile = optarg;
+            break;
+        case 'T': /* print a recorded session as a driver trace */
+            totrace(optarg);
+            exit(0);
         default:
             usage();
         }
     }
 
-    /* Install the signal handlers */
+    if (command != NULL)
+    {
+        exit(run_command(command));
+    }
 
-    /* These are the ones you will need to implement */
-    Signal(SIGINT, sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler); /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler); /* Terminated or stopped child */
+    // A remaining operand names a script to read instead of stdin
+    if (optind < argc)
+    {
+        if ((cmdin.fd = open(argv[optind], O_RDONLY | O_CLOEXEC)) < 0)
+        {
+            fprintf(stdout, "%s: %s\n", argv[optind], strerror(errno));
+            exit(127);
+        }
+        emit_prompt = 0;
+    }
+    interactive = (cmdin.fd == STDIN_FILENO);
 
-    /* This one provides a clean way to kill the shell */
-    Signal(SIGQUIT, sigquit_handler);
+    /* Redirect stderr to stdout (so that driver will get all output
+     * on the pipe connected to stdout) */
+    if (interactive)
+    {
+        dup2(1, 2);
+    }
+
+    /* Install the signal handlers */
+    install_handlers(interactive);
 
     /* Initialize the job list */
     initjobs(jobs);
 
+    /* Keep a history on a terminal, or wherever $TSH_HISTORY asks for one */
+    if (interactive && ((emit_prompt && isatty(STDIN_FILENO)) || env_get("TSH_HISTORY") != NULL))
+    {
+        hist_open();
+    }
+    if (statefile != NULL)
+    {
+        state_open(statefile);
+    }
+    if (record != NULL)
+    {
+        rec_open(record);
+    }
+    if (playback != NULL)
+    {
+        replay(playback, fast);
+    }
+
     /* Execute the shell's read/eval loop */
     while (1)
     {
 
+        /* Forget re-adopted jobs, coprocesses and memo jobs that have exited since the last command */
+        reap_adopted();
+        reap_coprocs();
+        reap_memos();
+        govern_tick(0);
+
         /* Read command line */
         if (emit_prompt)
         {
             printf("%s", prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin))
-        { /* End of file (ctrl-d) */
-            fflush(stdout);
-            exit(0);
+        if (ahead)
+        {
+            strcpy(cmdline, next);
+            ahead = 0;
+        }
+        else
+        {
+            waitinput();
+            if ((n = readcmd(cmdline, MAXLINE)) < 0)
+                app_error("read error");
+            if (n == 0)
+            { /* End of file (ctrl-d) */
+                fflush(stdout);
+                exit(interactive ? 0 : last_status);
+            }
+        }
+
+        /* Read a script one line ahead, so its last line can replace
+         * the shell as with -c (unless the shell still has logging to do) */
+        last = 0;
+        if (!interactive)
+        {
+            ahead = readcmd(next, MAXLINE) > 0;
+            last = !ahead && recfd < 0 && statefd < 0 && !govon;
+        }
+
+        /* Recall lines with !n and !prefix, and remember this one */
+        if (histfd >= 0)
+        {
+            if (hist_expand(cmdline) < 0)
+                continue;
+            hist_add(cmdline);
         }
 
         /* Evaluate the command line */
-        eval(cmdline);
+        rec_append(REC_INPUT, 0, cmdline, strlen(cmdline));
+        if (last)
+            eval_last(cmdline);
+        else
+            eval(cmdline);
+        rec_append(REC_DONE, 0, NULL, 0);
         fflush(stdout);
         fflush(stdout);
     }
@@ -165,6 +559,92 @@ int main(int argc, char **argv)
     exit(0); /* control never reaches here */
 }
 
+/*
+ * install_handlers - Install the shell's signal handlers. The SIGQUIT
+ *    handler only exists so the driver can stop an interactive shell.
+ */
+void install_handlers(int interactive)
+{
+    /* These are the ones you will need to implement */
+    Signal(SIGINT, sigint_handler);   /* ctrl-c */
+    Signal(SIGTSTP, sigtstp_handler); /* ctrl-z */
+    Signal(SIGCHLD, sigchld_handler); /* Terminated or stopped child */
+
+    /* This one provides a clean way to kill the shell */
+    if (interactive)
+    {
+        Signal(SIGQUIT, sigquit_handler);
+    }
+}
+
+/*
+ * run_command - Run the command line given with -c and return its
+ *    exit status. A single foreground program is exec'd in place of
+ *    the shell, so no handlers, job list or fork are needed for it.
+ */
+int run_command(char *command)
+{
+    char cmdline[MAXLINE];
+    struct cmdlist_t list;
+    char **argv;
+
+    // The parser expects the trailing newline that fgets would leave
+    if (strlen(command) > MAXLINE - 2)
+    {
+        app_error("Command line too long");
+    }
+    sprintf(cmdline, "%s\n", command);
+
+    if (parselist(cmdline, &list) < 0)
+    {
+        return 2;
+    }
+    if (list.ncmds == 0)
+    {
+        return 0;
+    }
+    argv = list.cmds[0].argv;
+    if (list.ncmds == 1 && !list.bg && *skipassign(argv) != NULL && !isbuiltin(*skipassign(argv)))
+    {
+        exec_inplace(argv);
+    }
+
+    // Builtins, lists and background jobs need the full shell machinery
+    install_handlers(0);
+    initjobs(jobs);
+    eval_list(&list, cmdline, 1);
+    fflush(stdout);
+    return last_status;
+}
+
+/*
+ * exec_inplace - Replace the shell with the program in argv, after
+ *    applying any leading VAR=value assignments to its environment.
+ *    Only returns control to the caller's parent by exiting.
+ */
+void exec_inplace(char **argv)
+{
+    char **words = skipassign(argv);
+
+    for (; argv < words; argv++)
+    {
+        env_put(*argv);
+    }
+    if (memofd[0] >= 0)
+    {
+        // A memo job writes into the capture files instead of the terminal
+        dup2(memofd[0], STDOUT_FILENO);
+        dup2(memofd[1], STDERR_FILENO);
+    }
+    if (execve(words[0], words, env_envp()) < 0)
+    {
+        // _exit, so a forked child cannot disturb the shell's stdio buffers
+        printf("%sCommand not found: %s\n", srcwhere, words[0]);
+        fflush(stdout);
+        _exit(1);
+    }
+}
+
 /*
  * eval - Evaluate the command line that the user has just typed in
  *
@@ -178,70 +658,300 @@ int main(int argc, char **argv)
 */
 void eval(char *cmdline)
 {
-    // The parent must use sigprocmask to block SIGCHLD signals before it forks the child
-    // Afterwards we unblock the signals by using sigprocmask after it adds the child to the job list by calling addjob
-    // Since children inherit the blocked vectors of their parents, the child must be sure to then unblock SIGCHLD signals before it execs the new program
+    struct cmdlist_t list; // Parsed command line
 
-    // After the fork, but before the execve, the child process should call setpgid(0,0), which puts the child in a new process group whose group ID is identical to the child's PID
-    // ** This ensures that there will be only one process, your shell, in the foreground process group
+    // Parse the command line into its list of commands
+    if (parselist(cmdline, &list) < 0)
+    {
+        last_status = 2;
+        return;
+    }
+
+    // If there is no command (meaning that the user has just pressed ENTER), don't do anything - display new prompt
+    if (list.ncmds == 0)
+    {
+        return;
+    }
 
-    char *argv[MAXARGS]; // List of Arguments
-    pid_t pid;           // Process ID
-    sigset_t mask;       // Blocking Signals
-    int bg;              // Foreground (fg) / Background (bg) - parseline returns 1 for bg
+    eval_list(&list, cmdline, 0);
+    return;
+}
 
-    // Parse the command line and build the argv array.
-    bg = parseline(cmdline, argv);
+/*
+ * eval_last - Evaluate the last line of a script like eval, except that
+ *    its final foreground program replaces the shell
+ */
+void eval_last(char *cmdline)
+{
+    struct cmdlist_t list; // Parsed command line
 
-    // If there is no first argument (meaning that the user has just pressed ENTER), don't do anything - display new prompt
-    if (argv[0] == NULL)
+    if (parselist(cmdline, &list) < 0)
+    {
+        last_status = 2;
+        return;
+    }
+    if (list.ncmds == 0)
     {
         return;
     }
+    eval_list(&list, cmdline, 1);
+}
+
+/*
+ * eval_list - Run the commands of a parsed command line in order,
+ *    honouring the ; && and || operators between them. A background
+ *    list with more than one command runs as a single job: a forked
+ *    subshell in its own process group runs the commands, so ctrl-z,
+ *    fg and bg act on the whole list. If exec_last is set, the final
+ *    foreground program replaces the shell instead of being forked.
+ */
+void eval_list(struct cmdlist_t *list, char *cmdline, int exec_last)
+{
+    struct cmd_t *cmd;
+    char **argv;   // The command's arguments
+    char **words;  // The command after any VAR=value prefix
+    char **rest;   // The command after a limit prefix
+    char *largv[MAXARGS + MAXCMDS]; // argv with the limit and memo prefixes removed
+    char entry[MAXPATH + 32]; // memo cache entry of the command
+    int memo;      // The command has a memo prefix
+    char cgroup[MAXPATH]; // cgroup of a background list
+    pid_t pid;     // Process ID of the subshell
+    sigset_t mask; // Blocking Signals
+    int i, n;
+
+    // A single command keeps the full command line (including any &) for the job list
+    if (list->ncmds == 1)
+    {
+        list->cmds[0].cmdline = cmdline;
+    }
 
-    // Evaluating whether argument is valid builtin_cmd
-    if (!builtin_cmd(argv))
+    if (list->bg && list->ncmds > 1)
     {
-        // Initially blocking SIGCHLD
-        _sigemptyset(&mask);                  // Initializing signal set
-        _sigaddset(&mask, SIGCHLD);           // Adding SIGCHLD to signal set
-        _sigprocmask(SIG_BLOCK, &mask, NULL); // Adding singals to SIG_BLOCK
+        // Same protocol as launch: block SIGCHLD until the job is added
+        _sigemptyset(&mask);
+        _sigaddset(&mask, SIGCHLD);
+        _sigprocmask(SIG_BLOCK, &mask, NULL);
+        cg_create(&deflimits, cgroup);
+        env_envp(); // Rebuilt here once, so the subshell inherits the cached envp
 
-        // Forking Child Process
         if ((pid = _fork()) == 0)
         {
-            _setpgid(0, 0);                         // Setting child's group
-            _sigprocmask(SIG_UNBLOCK, &mask, NULL); // Unblocking SIGCHLD
+            // The subshell and all of its commands share one process group
+            _setpgid(0, 0);
+            apply_limits(&deflimits, cgroup);
+            Signal(SIGINT, SIG_DFL);
+            Signal(SIGTSTP, SIG_DFL);
+            Signal(SIGCHLD, SIG_DFL);
+            _sigprocmask(SIG_UNBLOCK, &mask, NULL);
 
-            // Checking command
-            if (execve(argv[0], argv, environ) < 0)
+            subshell = 1;
+            initjobs(jobs);
+            list->bg = 0;
+            eval_list(list, cmdline, 0);
+            fflush(stdout);
+            _exit(last_status);
+        }
+
+        setpgid(pid, pid); // Also from the parent, so the group exists before it is signalled
+        addjob(jobs, pid, BG, cmdline);
+        if (getjobpid(jobs, pid) != NULL)
+        {
+            strcpy(getjobpid(jobs, pid)->cgroup, cgroup);
+        }
+        _sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        last_status = 0;
+        printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline);
+        return;
+    }
+
+    for (i = 0; i < list->ncmds; i++)
+    {
+        cmd = &list->cmds[i];
+
+        // Skip commands whose && or || condition does not hold; the status carries over
+        if (i > 0 && ((list->cmds[i - 1].op == OP_AND && last_status != 0) ||
+                      (list->cmds[i - 1].op == OP_OR && last_status == 0)))
+        {
+            continue;
+        }
+
+        // Assignments on their own change the shell's environment;
+        // in front of a program they only apply to that program
+        last_status = 0;
+        argv = cmd->argv;
+        words = skipassign(argv);
+        if (*words == NULL)
+        {
+            for (words = argv; *words != NULL; words++)
             {
-                printf("Command not found: %s\n", argv[0]);
-                exit(1);
+                env_put(*words);
             }
-            return;
+            continue;
         }
 
-        // Parent
-        else
+        // "limit spec... cmd" runs cmd with extra limits on top of the defaults
+        joblimits = deflimits;
+        if (!strcmp(words[0], "limit") && words[1] != NULL && strchr(words[1], '=') != NULL)
         {
-            addjob(jobs, pid, bg ? BG : FG, cmdline); // Adding process to job list, depending on BG/FG
-            _sigprocmask(SIG_UNBLOCK, &mask, NULL);   // Retrieving SIGCHLD signal by unblocking
+            if ((rest = parselimits(words + 1, &joblimits)) == NULL)
+            {
+                last_status = 1;
+                continue;
+            }
+            if (*rest != NULL && strchr(*rest, '=') != NULL)
+            {
+                // A misspelt limit must not turn into a VAR=value prefix
+                printf("limit: unknown resource: %s\n", *rest);
+                last_status = 1;
+                continue;
+            }
+            if (*rest != NULL)
+            {
+                for (n = 0; argv + n < words; n++)
+                {
+                    largv[n] = argv[n];
+                }
+                while ((largv[n++] = *rest++) != NULL)
+                    ;
+                words = largv + (words - argv);
+                argv = largv;
+            }
+        }
 
-            if (!bg)
+        // "memo cmd" answers cmd from the memo cache when it can
+        memo = 0;
+        if (!strcmp(words[0], "memo") && words[1] != NULL && words[1][0] != '-')
+        {
+            for (n = 0; argv + n < words; n++)
             {
-                waitfg(pid); // Reaping when job is Terminated
+                largv[n] = argv[n];
             }
-            else
+            rest = words + 1;
+            while ((largv[n++] = *rest++) != NULL)
+                ;
+            words = largv + (words - argv);
+            argv = largv;
+            memo = !list->bg; // Background jobs simply run uncached
+            if (isbuiltin(words[0]))
             {
-                printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline); // Printing bg process info
+                printf("memo: %s is a builtin\n", words[0]);
+                last_status = 2;
+                continue;
             }
-            return;
+        }
+        if (memo && memo_key(argv, entry) == 0)
+        {
+            if (memo_replay(entry) == 0)
+            {
+                continue;
+            }
+            memo_begin();
+            n = launch(argv, cmd->cmdline, 0);
+            memo_end(entry, !n);
+            if (n)
+            {
+                break;
+            }
+            continue;
+        }
+
+        // Evaluating whether argument is valid builtin_cmd
+        if (builtin_cmd(words))
+        {
+            continue;
+        }
+
+        if (exec_last && i == list->ncmds - 1 && !list->bg)
+        {
+            fflush(stdout); // execve would drop what earlier commands printed
+            apply_limits(&joblimits, "");
+            exec_inplace(argv);
+        }
+
+        // A command killed or stopped by ctrl-c/ctrl-z abandons the rest of the list
+        if (launch(argv, cmd->cmdline, list->bg))
+        {
+            break;
         }
     }
     return;
 }
 
+/*
+ * launch - Fork a child process and run argv in it. If bg is false,
+ *    wait for the job to stop or terminate. Returns true if the
+ *    foreground job was killed or stopped by a signal.
+ */
+int launch(char **argv, char *cmdline, int bg)
+{
+    // The parent must use sigprocmask to block SIGCHLD signals before it forks the child
+    // Afterwards we unblock the signals by using sigprocmask after it adds the child to the job list by calling addjob
+    // Since children inherit the blocked vectors of their parents, the child must be sure to then unblock SIGCHLD signals before it execs the new program
+
+    // After the fork, but before the execve, the child process should call setpgid(0,0), which puts the child in a new process group whose group ID is identical to the child's PID
+    // ** This ensures that there will be only one process, your shell, in the foreground process group
+
+    pid_t pid;     // Process ID
+    sigset_t mask; // Blocking Signals
+    int status;    // Wait status inside a subshell
+    char cgroup[MAXPATH]; // The job's cgroup, if it gets one
+
+    env_envp(); // Rebuilt here once, so the child inherits the cached envp
+
+    // Inside a background subshell the commands stay in the subshell's
+    // process group and are reaped directly, since there is no job list
+    if (subshell)
+    {
+        if ((pid = _fork()) == 0)
+        {
+            apply_limits(&joblimits, "");
+            exec_inplace(argv);
+        }
+        if (waitpid(pid, &status, 0) < 0)
+        {
+            unix_error("waitpid error");
+        }
+        last_status = status2code(status);
+        return WIFSIGNALED(status);
+    }
+
+    // Initially blocking SIGCHLD
+    _sigemptyset(&mask);                  // Initializing signal set
+    _sigaddset(&mask, SIGCHLD);           // Adding SIGCHLD to signal set
+    _sigprocmask(SIG_BLOCK, &mask, NULL); // Adding singals to SIG_BLOCK
+    cg_create(&joblimits, cgroup);        // Giving a limited job its own cgroup
+
+    // Forking Child Process
+    if ((pid = _fork()) == 0)
+    {
+        _setpgid(0, 0);                         // Setting child's group
+        apply_limits(&joblimits, cgroup);       // Applying resource limits
+        _sigprocmask(SIG_UNBLOCK, &mask, NULL); // Unblocking SIGCHLD
+
+        // Checking command
+        exec_inplace(argv);
+    }
+
+    // Parent
+    setpgid(pid, pid); // Also from the parent, so the group exists before it is signalled
+    addjob(jobs, pid, bg ? BG : FG, cmdline); // Adding process to job list, depending on BG/FG
+    if (getjobpid(jobs, pid) != NULL)
+    {
+        strcpy(getjobpid(jobs, pid)->cgroup, cgroup);
+    }
+    fg_interrupted = 0;
+    _sigprocmask(SIG_UNBLOCK, &mask, NULL); // Retrieving SIGCHLD signal by unblocking
+
+    if (!bg)
+    {
+        waitfg(pid); // Reaping when job is Terminated
+        return fg_interrupted;
+    }
+
+    printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline); // Printing bg process info
+    return 0;
+}
+
 /*
  * parseline - Parse the command line and build the argv array.
  *
@@ -306,28 +1016,169 @@ int parseline(const char *cmdline, char **argv)
 }
 
 /*
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.
+ * parselist - Parse a command line into a list of commands joined by
+ *    ;, && and ||, with an optional trailing & that puts the whole
+ *    list in the background. Arguments are split on spaces and a
+ *    quoted argument runs from a leading ' to the next ', as in
+ *    parseline. Returns 0 on success, or -1 after printing a message
+ *    if the line is malformed.
  */
-int builtin_cmd(char **argv)
+int parselist(const char *cmdline, struct cmdlist_t *list)
 {
-    // Comapre input to "quit"
-    if (!strcmp(argv[0], "quit"))
+    const char *p = cmdline;   /* traverses the command line */
+    const char *start;         /* first character of the current command */
+    const char *end = NULL;    /* one past the last argument of the command */
+    char *arg = list->args;    /* next free byte of argument storage */
+    char *text = list->text;   /* next free byte of command text storage */
+    char **argv = list->argv;  /* next free argv slot */
+    struct cmd_t *cmd;         /* command being built */
+    int argc = 0;              /* arguments in the current command */
+    int op, len;
+
+    list->ncmds = 0;
+    list->bg = 0;
+    cmd = &list->cmds[0];
+    cmd->argv = argv;
+    start = NULL;
+
+    while (1)
     {
-        if (verbose)
+        while (*p == ' ' || *p == '\t' || *p == '\n') /* ignore spaces */
+            p++;
+
+        /* An operator or the end of the line finishes the current command */
+        op = -1;
+        len = 1;
+        if (*p == '\0')
+            op = OP_END;
+        else if (*p == ';')
+            op = OP_SEQ;
+        else if (p[0] == '&' && p[1] == '&')
+            op = OP_AND, len = 2;
+        else if (p[0] == '|' && p[1] == '|')
+            op = OP_OR, len = 2;
+        else if (*p == '&')
         {
-            printf("Quit Command Detected\n");
+            /* & is only allowed at the very end and applies to the whole list */
+            const char *rest = p + 1;
+            while (*rest == ' ' || *rest == '\t' || *rest == '\n')
+                rest++;
+            if (argc == 0 || *rest != '\0')
+            {
+                printf("%ssyntax error near '&'\n", srcwhere);
+                return -1;
+            }
+            list->bg = 1;
+            op = OP_END;
         }
-        exit(0);
-    }
 
-    // Comapre input to "jobs"
-    else if (!strcmp(argv[0], "jobs"))
-    {
-        if (verbose)
+        if (op >= 0)
+        {
+            if (argc == 0)
+            {
+                /* Blank lines and a trailing ; are fine, empty commands are not */
+                if (op == OP_END && (list->ncmds == 0 || list->cmds[list->ncmds - 1].op == OP_SEQ))
+                {
+                    if (list->ncmds > 0)
+                        list->cmds[list->ncmds - 1].op = OP_END;
+                    return 0;
+                }
+                if (op == OP_END)
+                    printf("%ssyntax error near end of line\n", srcwhere);
+                else
+                    printf("%ssyntax error near '%.*s'\n", srcwhere, len, p);
+                return -1;
+            }
+
+            *argv++ = NULL;
+            cmd->op = op;
+            cmd->cmdline = text;
+            memcpy(text, start, end - start);
+            text += end - start;
+            *text++ = '\n';
+            *text++ = '\0';
+            list->ncmds++;
+            if (op == OP_END)
+                return 0;
+
+            if (list->ncmds == MAXCMDS)
+            {
+                printf("%sToo many commands in list\n", srcwhere);
+                return -1;
+            }
+            p += len;
+            cmd = &list->cmds[list->ncmds];
+            cmd->argv = argv;
+            argc = 0;
+            continue;
+        }
+
+        /* Otherwise the next argument starts here */
+        if (argv - list->argv >= MAXARGS + MAXCMDS - 1 - list->ncmds)
+        {
+            printf("%sToo many arguments\n", srcwhere);
+            return -1;
+        }
+        if (argc == 0)
+            start = p;
+        *argv++ = arg;
+        argc++;
+        if (*p == '\'')
+        {
+            p++;
+            while (*p && *p != '\'' && *p != '\n')
+                *arg++ = *p++;
+            if (*p == '\'')
+                p++;
+        }
+        else
+        {
+            while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != ';' && *p != '&' &&
+                   !(p[0] == '|' && p[1] == '|'))
+                *arg++ = *p++;
+        }
+        *arg++ = '\0';
+        end = p;
+    }
+}
+
+/*
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately.
+ */
+int builtin_cmd(char **argv)
+{
+    // Comapre input to "quit"
+    if (!strcmp(argv[0], "quit"))
+    {
+        if (verbose)
+        {
+            printf("Quit Command Detected\n");
+        }
+        exit(0);
+    }
+
+    // Comapre input to "jobs"
+    else if (!strcmp(argv[0], "jobs"))
+    {
+        if (verbose)
         {
             printf("Jobs Command Detected\n");
         }
+        if (argv[1] != NULL && !strcmp(argv[1], "-l"))
+        {
+            // Long listing: each job followed by its resource usage
+            int i;
+            for (i = 0; i < MAXJOBS; i++)
+            {
+                if (jobs[i].pid != 0)
+                {
+                    printjob(&jobs[i]);
+                    printusage(&jobs[i]);
+                }
+            }
+            return 1;
+        }
         listjobs(jobs);
         return 1;
     }
@@ -343,400 +1194,3863 @@ int builtin_cmd(char **argv)
         return 1;
     }
 
+    // Comapre input to "export"
+    else if (!strcmp(argv[0], "export"))
+    {
+        do_export(argv);
+        return 1;
+    }
+
+    // Comapre input to "limit"
+    else if (!strcmp(argv[0], "limit"))
+    {
+        do_limit(argv);
+        return 1;
+    }
+
+    // Comapre input to "wait"
+    else if (!strcmp(argv[0], "wait"))
+    {
+        do_wait(argv);
+        return 1;
+    }
+
+    // Comapre input to "coproc", "send" or "recv"
+    else if (!strcmp(argv[0], "coproc"))
+    {
+        do_coproc(argv);
+        return 1;
+    }
+    else if (!strcmp(argv[0], "send"))
+    {
+        do_send(argv);
+        return 1;
+    }
+    else if (!strcmp(argv[0], "recv"))
+    {
+        do_recv(argv);
+        return 1;
+    }
+
+    // Comapre input to "kill"
+    else if (!strcmp(argv[0], "kill"))
+    {
+        do_kill(argv);
+        return 1;
+    }
+
+    // Comapre input to "disown"
+    else if (!strcmp(argv[0], "disown"))
+    {
+        do_disown(argv);
+        return 1;
+    }
+
+    // Comapre input to "memo" (the prefix form is handled by eval_list)
+    else if (!strcmp(argv[0], "memo"))
+    {
+        do_memo(argv);
+        return 1;
+    }
+
+    // Comapre input to "govern"
+    else if (!strcmp(argv[0], "govern"))
+    {
+        do_govern(argv);
+        return 1;
+    }
+
+    // Comapre input to "source"
+    else if (!strcmp(argv[0], "source"))
+    {
+        do_source(argv);
+        return 1;
+    }
+
+    // Comapre input to "history"
+    else if (!strcmp(argv[0], "history"))
+    {
+        do_history(argv);
+        return 1;
+    }
+
+    // Comapre input to "unset"
+    else if (!strcmp(argv[0], "unset"))
+    {
+        do_unset(argv);
+        return 1;
+    }
+
     // Not a built in command
     return 0;
 }
 
 /*
- * do_bgfg - Execute the builtin bg and fg commands
+ * isbuiltin - Return true if name is one of the commands that
+ *    builtin_cmd handles itself
  */
-void do_bgfg(char **argv)
+int isbuiltin(char *name)
 {
-    struct job_t *job;
-    char *id;
-    int jid = 0;
-    pid_t pid;
-
-    id = argv[1];
+    static const char *builtins[] = {"quit", "jobs", "bg", "fg", "export", "unset", "limit", "wait",
+                                     "coproc", "send", "recv", "kill", "disown", "memo", "govern", "source", "history", NULL};
+    int i;
 
-    // Invalid ID
-    if (id == NULL)
+    for (i = 0; builtins[i] != NULL; i++)
     {
-        printf("%s command requires PID or %%jobid argument\n", argv[0]);
-        return;
+        if (!strcmp(name, builtins[i]))
+        {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    // We will first get the job from the supplied jid or pid and then change the state later. 
-    
-    if (id[0] == '%')
-    {
-        // Here, user has supplied JID. We get the corresponding job. 
-        jid = atoi(&id[1]);
-        job = getjobjid(jobs, jid); // Getting Job
+/*
+ * do_export - Execute the builtin export command. With no arguments
+ *    print the environment, otherwise apply each NAME=value. Every
+ *    variable is already exported, so a bare NAME is accepted as is.
+ */
+void do_export(char **argv)
+{
+    char **envp;
+    int i;
 
-        // If the job returned is NULL or the jid is 0 (no jid should be zero) - we return with error msg
-        if (job==NULL || jid==0)
+    if (argv[1] == NULL)
+    {
+        for (envp = env_envp(); *envp != NULL; envp++)
         {
-            //%2: No such job
-            printf("%s: No such job\n", id);
-            return;
+            printf("%s\n", *envp);
         }
+        return;
     }
 
-    // The other option is that user has supplied PID. We get the corresponding job. 
-    else if (isdigit(id[0]))
+    for (i = 1; argv[i] != NULL; i++)
     {
-        pid = atoi(id);
-        job = getjobpid(jobs, pid);
-
-        // Again, if job returned is NULL or pid is 0, we return with error msg. 
-        if (job==NULL || pid==0)
+        if (isassign(argv[i]))
         {
-            //(2): No such process
-            printf("(%d): No such process\n", pid);
-            return;
+            env_put(argv[i]);
+        }
+        else if (!isalpha(argv[i][0]) && argv[i][0] != '_')
+        {
+            printf("export: %s: not a valid identifier\n", argv[i]);
+            last_status = 1;
         }
     }
+}
 
-    // The default case is that user has supplied some garbage value for the jid/pid starting without digit or %. 
-    else
+/*
+ * do_unset - Execute the builtin unset command
+ */
+void do_unset(char **argv)
+{
+    int i;
+
+    for (i = 1; argv[i] != NULL; i++)
     {
-        printf("%s: argument must be PID of %%jobid\n", argv[0]);
-        return;
+        env_unset(argv[i]);
     }
+}
 
-    pid = job->pid;
+/*
+ * do_wait - Execute the builtin wait command
+ *
+ * wait             waits until no job is running
+ * wait %jid|pid... waits for each job to stop or exit, status of the last
+ * wait -n          waits for the next job to stop or exit, and its status
+ *
+ * The shell sleeps in waitevent until sigchld_handler records a job
+ * event, and ctrl-c ends the wait with status 130.
+ */
+void do_wait(char **argv)
+{
+    struct job_t *job;
+    sigset_t mask, prev;
+    pid_t pid;
+    int i, seen;
 
-    // Resuming program when SIGCONT received
-    kill(-pid, SIGCONT);
+    // SIGCHLD and SIGINT stay blocked except inside waitevent
+    _sigemptyset(&mask);
+    _sigaddset(&mask, SIGCHLD);
+    _sigaddset(&mask, SIGINT);
+    _sigprocmask(SIG_BLOCK, &mask, &prev);
+    int_pending = 0;
 
-    // Now that we have the job, we can "do" fg/bg accordingly
-    if (!strcmp("fg", argv[0]))
+    if (argv[1] == NULL)
     {
-        // This command moves BG to FG. Change state and call waitfg. 
-        job->state = FG;
-        waitfg(job->pid);
+        while (!int_pending)
+        {
+            for (i = 0; i < MAXJOBS && jobs[i].state != BG && !jobs[i].governed; i++)
+                ;
+            if (i == MAXJOBS)
+                break;
+            waitevent(&prev);
+        }
+    }
+    else if (!strcmp(argv[1], "-n"))
+    {
+        for (i = 0; i < MAXJOBS; i++)
+            if (jobs[i].state == BG || jobs[i].governed)
+                break;
+        if (i == MAXJOBS)
+        {
+            last_status = 127; // Nothing to wait for
+        }
+        else
+        {
+            seen = nevents;
+            while (nevents == seen && !int_pending)
+            {
+                waitevent(&prev);
+            }
+            if (nevents != seen)
+            {
+                last_status = status2code(events[seen % MAXEVENTS].status);
+            }
+        }
     }
     else
     {
-        // This command moves FG to BG. Change state and print that jobs is now in BG. 
-        job->state = BG;
-        printf("[%d] (%d) %s\n", job->jid, job->pid, job->cmdline);
+        for (i = 1; argv[i] != NULL && !int_pending; i++)
+        {
+            if (argv[i][0] == '%')
+            {
+                // A job that has already been reaped is found by its last event
+                if ((job = getjobjid(jobs, atoi(&argv[i][1]))) != NULL)
+                {
+                    pid = job->pid;
+                }
+                else if ((pid = eventpid(atoi(&argv[i][1]))) == 0)
+                {
+                    printf("%s: No such job\n", argv[i]);
+                    last_status = 127;
+                    continue;
+                }
+            }
+            else if (isdigit(argv[i][0]))
+            {
+                pid = atoi(argv[i]);
+            }
+            else
+            {
+                printf("wait: argument must be PID or %%jobid\n");
+                last_status = 2;
+                continue;
+            }
+            last_status = waitjob(pid, &prev);
+        }
     }
 
-    return;
+    if (int_pending)
+    {
+        last_status = 130;
+        int_pending = 0;
+    }
+    _sigprocmask(SIG_SETMASK, &prev, NULL);
 }
 
 /*
- * waitfg - Block until process pid is no longer the foreground process
+ * waitjob - Wait until job pid is no longer running and return its
+ *    exit status. Called with SIGCHLD and SIGINT blocked; prev is the
+ *    mask to sleep with. A job that has already been reaped is looked
+ *    up in the recent job events.
  */
-void waitfg(pid_t pid)
+int waitjob(pid_t pid, sigset_t *prev)
 {
-    // First, we get the FG job
-    struct job_t *fg_job = getjobpid(jobs, pid);
-
-    if (verbose)
-        printf("Waiting FG\n");
+    struct job_t *job;
+    int status;
 
-    if (pid == 0)
+    // A job paused by the governor still counts as running
+    while ((job = getjobpid(jobs, pid)) != NULL && (job->state == BG || job->governed) && !int_pending)
     {
-        return;
+        waitevent(prev);
+    }
+    if (int_pending)
+    {
+        return 130;
     }
+    if (jobevent(pid, &status))
+    {
+        return status2code(status);
+    }
+    if (job != NULL)
+    {
+        return 0; // Stopped, or in the foreground, before any event
+    }
+    printf("(%d): No such process\n", pid);
+    return 127;
+}
 
-    // Wait until FG job is finished using sleep()
-    if (fg_job != NULL)
+/*
+ * jobevent - Find the latest recorded event of job pid. Returns true
+ *    and sets status if there is one.
+ */
+int jobevent(pid_t pid, int *status)
+{
+    int i;
+
+    for (i = nevents - 1; i >= 0 && i >= nevents - MAXEVENTS; i--)
     {
-        while (pid == fgpid(jobs))
+        if (events[i % MAXEVENTS].pid == pid)
         {
-            sleep(1);
+            *status = events[i % MAXEVENTS].status;
+            return 1;
         }
     }
-    return;
+    return 0;
 }
 
-/*****************
- * Signal handlers
- *****************/
+/* eventpid - Return the pid of the latest recorded event of job jid, or 0 */
+pid_t eventpid(int jid)
+{
+    int i;
+
+    for (i = nevents - 1; jid > 0 && i >= 0 && i >= nevents - MAXEVENTS; i--)
+    {
+        if (events[i % MAXEVENTS].jid == jid)
+        {
+            return events[i % MAXEVENTS].pid;
+        }
+    }
+    return 0;
+}
 
 /*
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.
+ * do_coproc - Execute the builtin coproc command: "coproc name cmd args"
+ *    starts cmd as a background job whose stdin and stdout are pipes
+ *    to the shell, so send and recv can talk to the same warm process
+ *    many times. It is an ordinary job for jobs, fg, bg and ctrl-c/z.
  */
-void sigchld_handler(int sig)
+void do_coproc(char **argv)
 {
+    struct coproc_t *cp;
+    char cmdline[MAXLINE];
+    int in[2], out[2];
+    sigset_t mask;
     pid_t pid;
-    struct job_t *job;
-    int status; // this status is set by the waitpid function
+    int i, len;
 
-    if (verbose)
+    if (argv[1] == NULL || argv[2] == NULL)
     {
-        printf("SIGCHLD signal recieved\n");
+        printf("coproc command requires a name and a command\n");
+        last_status = 2;
+        return;
+    }
+    if (strlen(argv[1]) >= MAXNAME)
+    {
+        printf("coproc: %s: name too long\n", argv[1]);
+        last_status = 1;
+        return;
     }
 
-    // Here we modify default behviour of the waitpid function.
-    // We pass an integer which gets the status of the child.
-    // The mode is set to WNOHANG|WUNTRACED - returns the pid of one of the
-    //  stopped or terminated children, 0 if none. (from textbook)
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0)
+    // A name can be reused once its old coprocess has exited
+    if ((cp = getcoproc(argv[1])) != NULL)
     {
-        // Now that we have status of the child, we can either delete, or change state.
+        if (getjobpid(jobs, cp->pid) != NULL)
+        {
+            printf("coproc: %s: already running\n", argv[1]);
+            last_status = 1;
+            return;
+        }
+        closecoproc(cp);
+    }
+    for (cp = coprocs; cp < coprocs + MAXJOBS && cp->name[0] != '\0'; cp++)
+        ;
+    if (cp == coprocs + MAXJOBS)
+    {
+        printf("Tried to create too many coprocesses\n");
+        last_status = 1;
+        return;
+    }
+
+    // The job list shows the command as typed
+    for (i = 0, len = 0; argv[i] != NULL && len < MAXLINE - 2; i++)
+        len += snprintf(cmdline + len, MAXLINE - 1 - len, i ? " %s" : "%s", argv[i]);
+    strcpy(cmdline + (len < MAXLINE - 2 ? len : MAXLINE - 2), "\n");
+
+    // The shell's ends are close-on-exec so other jobs never hold them open
+    if (pipe2(in, O_CLOEXEC) < 0)
+        unix_error("pipe error");
+    if (pipe2(out, O_CLOEXEC) < 0)
+        unix_error("pipe error");
+
+    // Same protocol as launch: block SIGCHLD until the job is added
+    _sigemptyset(&mask);
+    _sigaddset(&mask, SIGCHLD);
+    _sigprocmask(SIG_BLOCK, &mask, NULL);
+    env_envp(); // Rebuilt here once, so the coprocess inherits the cached envp
+
+    if ((pid = _fork()) == 0)
+    {
+        _setpgid(0, 0);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        _sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        exec_inplace(argv + 2);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    fcntl(in[1], F_SETFL, O_NONBLOCK); // send waits in poll, where ctrl-c can reach it
+    strcpy(cp->name, argv[1]);
+    cp->pid = pid;
+    cp->infd = in[1];
+    cp->outfd = out[0];
+    cp->len = 0;
+    setpgid(pid, pid); // Also from the parent, so the group exists before it is signalled
+    addjob(jobs, pid, BG, cmdline);
+    _sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline);
+}
+
+/*
+ * do_send - Execute the builtin send command: "send name words..."
+ *    writes the words as one line to the coprocess's stdin, and
+ *    "send -e name" closes its stdin so it sees end of file. If the
+ *    pipe is full it waits for room, and ctrl-c ends the wait (status 130).
+ */
+void do_send(char **argv)
+{
+    struct coproc_t *cp;
+    struct pollfd pfd;
+    char line[MAXLINE];
+    int eof, i, len;
+    ssize_t n;
+
+    eof = argv[1] != NULL && !strcmp(argv[1], "-e");
+    if (argv[1 + eof] == NULL)
+    {
+        printf("send command requires a coprocess name\n");
+        last_status = 2;
+        return;
+    }
+    if ((cp = getcoproc(argv[1 + eof])) == NULL || cp->infd < 0)
+    {
+        printf("send: %s: No such coprocess\n", argv[1 + eof]);
+        last_status = 1;
+        return;
+    }
+    if (eof)
+    {
+        close(cp->infd);
+        cp->infd = -1;
+        return;
+    }
+
+    for (i = 2, len = 0; argv[i] != NULL && len < MAXLINE - 2; i++)
+        len += snprintf(line + len, MAXLINE - 1 - len, i > 2 ? " %s" : "%s", argv[i]);
+    if (len > MAXLINE - 2)
+        len = MAXLINE - 2;
+    line[len++] = '\n';
+
+    // A coprocess that has exited must not kill the shell with SIGPIPE
+    Signal(SIGPIPE, SIG_IGN);
+    int_pending = 0;
+    for (i = 0; i < len; i += n)
+    {
+        // Like recv, wait in poll so that ctrl-c gets us out
+        n = 0;
+        pfd.fd = cp->infd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        {
+            printf("send: %s: %s\n", cp->name, strerror(errno));
+            last_status = 1;
+            break;
+        }
+        if (int_pending)
+        {
+            int_pending = 0;
+            last_status = 130;
+            break;
+        }
+        if (!(pfd.revents & (POLLOUT | POLLERR | POLLHUP)))
+            continue;
+        if ((n = write(cp->infd, line + i, len - i)) < 0)
+        {
+            n = 0;
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            printf("send: %s: %s\n", cp->name, strerror(errno));
+            last_status = 1;
+            break;
+        }
+    }
+    Signal(SIGPIPE, SIG_DFL);
+}
+
+/*
+ * do_recv - Execute the builtin recv command: "recv name" prints the
+ *    next line of output from the coprocess. It blocks until a line
+ *    arrives, the coprocess closes its stdout (status 1) or ctrl-c
+ *    (status 130).
+ */
+void do_recv(char **argv)
+{
+    struct coproc_t *cp;
+    struct pollfd pfd;
+    char *nl;
+    ssize_t n;
+
+    if (argv[1] == NULL)
+    {
+        printf("recv command requires a coprocess name\n");
+        last_status = 2;
+        return;
+    }
+    if ((cp = getcoproc(argv[1])) == NULL)
+    {
+        printf("recv: %s: No such coprocess\n", argv[1]);
+        last_status = 1;
+        return;
+    }
+
+    int_pending = 0;
+    while ((nl = memchr(cp->buf, '\n', cp->len)) == NULL)
+    {
+        // poll is never restarted after a handler, so ctrl-c gets us out
+        pfd.fd = cp->outfd;
+        pfd.events = POLLIN;
+        if (cp->len == MAXLINE || (poll(&pfd, 1, -1) < 0 && errno != EINTR))
+            break;
+        if (int_pending)
+        {
+            int_pending = 0;
+            last_status = 130;
+            return;
+        }
+        if (!(pfd.revents & (POLLIN | POLLHUP)))
+            continue;
+        if ((n = read(cp->outfd, cp->buf + cp->len, MAXLINE - cp->len)) <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        cp->len += n;
+    }
+
+    // A final line without a newline is still a reply
+    if (nl == NULL && cp->len > 0)
+        nl = cp->buf + cp->len - 1;
+    if (nl == NULL)
+    {
+        if (getjobpid(jobs, cp->pid) == NULL)
+            closecoproc(cp);
+        last_status = 1;
+        return;
+    }
+    fwrite(cp->buf, 1, nl - cp->buf + 1, stdout);
+    if (*nl != '\n')
+        putchar('\n');
+    cp->len -= nl - cp->buf + 1;
+    memmove(cp->buf, nl + 1, cp->len);
+}
+
+/* getcoproc - Find a coprocess by name */
+struct coproc_t *getcoproc(char *name)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (coprocs[i].name[0] != '\0' && !strcmp(coprocs[i].name, name))
+            return &coprocs[i];
+    return NULL;
+}
+
+/*
+ * reap_coprocs - Free the coprocesses whose job has gone, once all of
+ *    their output has been read. Called from the main loop rather than
+ *    sigchld_handler, so it never pulls a pipe out from under recv.
+ */
+void reap_coprocs(void)
+{
+    struct coproc_t *cp;
+    struct pollfd pfd;
+    sigset_t mask, prev;
+
+    _sigemptyset(&mask);
+    _sigaddset(&mask, SIGCHLD);
+    _sigprocmask(SIG_BLOCK, &mask, &prev);
+    for (cp = coprocs; cp < coprocs + MAXJOBS; cp++)
+    {
+        if (cp->name[0] == '\0' || getjobpid(jobs, cp->pid) != NULL)
+            continue;
+        if (cp->infd >= 0)
+        {
+            close(cp->infd);
+            cp->infd = -1;
+        }
+        pfd.fd = cp->outfd;
+        pfd.events = POLLIN;
+        if (cp->len == 0 && !(poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)))
+            closecoproc(cp);
+    }
+    _sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* closecoproc - Close the pipes of a finished coprocess and free its slot */
+void closecoproc(struct coproc_t *cp)
+{
+    if (cp->infd >= 0)
+        close(cp->infd);
+    close(cp->outfd);
+    cp->name[0] = '\0';
+}
+
+/* Signals the kill builtin knows by name */
+static const struct
+{
+    char *name;
+    int sig;
+} signames[] = {{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+                {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+                {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {NULL, 0}};
+
+/* signum - Map "9", "KILL" or "SIGKILL" to a signal number, -1 if unknown */
+int signum(char *name)
+{
+    int i;
+
+    if (isdigit(name[0]))
+        return atoi(name);
+    if (!strncmp(name, "SIG", 3))
+        name += 3;
+    for (i = 0; signames[i].name != NULL; i++)
+        if (!strcmp(name, signames[i].name))
+            return signames[i].sig;
+    return -1;
+}
+
+/* range_cmp - qsort comparison of two jid ranges by their start */
+int range_cmp(const void *a, const void *b)
+{
+    return ((int *)a)[0] - ((int *)b)[0];
+}
+
+/*
+ * killset_slot - Return the slot of key in a kill target set, or the
+ *    free slot (-1) where it would go
+ */
+int killset_slot(int *set, int key)
+{
+    unsigned int i = ((unsigned int)key * 2654435761u) & (KILLSET - 1);
+
+    while (set[i] != -1 && set[i] != key)
+        i = (i + 1) & (KILLSET - 1);
+    return i;
+}
+
+/*
+ * do_kill - Execute the builtin kill command
+ *
+ * kill [-SIG] target...  where a target is %jid, a range %lo-%hi, a pid,
+ * %running or %stopped. Jobs are signalled as process groups, like
+ * ctrl-c does. All the job targets are collected first: the ranges
+ * are merged into sorted disjoint spans and the pids go into a hash
+ * set, so the one pass over the job list tests each job in O(log n).
+ * Pids that are not jobs are signalled directly. Prints how many jobs
+ * were reached and how many targets failed.
+ */
+void do_kill(char **argv)
+{
+    int ranges[MAXARGS][2];        /* jid ranges selected by %jid and %lo-%hi */
+    int spans[MAXARGS][2];         /* the ranges sorted and merged */
+    int singles[MAXARGS];          /* %jid targets named on their own */
+    int jidset[KILLSET];           /* the singles, hashed */
+    char jidhit[KILLSET] = {0};    /* the single matched a job */
+    pid_t pids[MAXARGS];           /* pid targets */
+    int pidset[KILLSET];           /* the pids, hashed */
+    char pidhit[KILLSET] = {0};    /* the pid matched a job */
+    int running = 0, stopped = 0;  /* %running, %stopped */
+    int sig = SIGTERM, npids = 0, nranges = 0, nspans = 0, nsingles = 0, reached = 0, failed = 0;
+    int i, j, lo, hi, match;
+    struct job_t *job;
+    sigset_t mask, prev;
+    char *dash, *end;
+
+    argv++;
+    if (*argv != NULL && (*argv)[0] == '-')
+    {
+        if (!strcmp(*argv, "-l"))
+        {
+            for (i = 0; signames[i].name != NULL; i++)
+                printf("%2d) SIG%s\n", signames[i].sig, signames[i].name);
+            return;
+        }
+        if ((sig = signum(*argv + 1)) < 0)
+        {
+            printf("kill: %s: invalid signal specification\n", *argv + 1);
+            last_status = 1;
+            return;
+        }
+        argv++;
+    }
+    if (*argv == NULL)
+    {
+        printf("kill command requires PID or %%jobid argument\n");
+        last_status = 2;
+        return;
+    }
+
+    // Collect the targets
+    for (; *argv != NULL; argv++)
+    {
+        if (!strcmp(*argv, "%running"))
+            running = 1;
+        else if (!strcmp(*argv, "%stopped"))
+            stopped = 1;
+        else if ((*argv)[0] == '%' && isdigit((*argv)[1]) && nranges < MAXARGS)
+        {
+            // jids are not bounded by MAXJOBS, so keep the ranges themselves
+            lo = hi = atoi(*argv + 1);
+            if ((dash = strchr(*argv, '-')) != NULL)
+            {
+                end = dash + (dash[1] == '%' ? 2 : 1);
+                if (!isdigit(*end) || (hi = atoi(end)) < lo)
+                {
+                    printf("kill: %s: bad job range\n", *argv);
+                    failed++;
+                    continue;
+                }
+            }
+            if (dash == NULL)
+                singles[nsingles++] = lo;
+            ranges[nranges][0] = lo;
+            ranges[nranges][1] = hi;
+            nranges++;
+        }
+        else if (isdigit((*argv)[0]) && npids < MAXARGS)
+            pids[npids++] = atoi(*argv);
+        else
+        {
+            printf("kill: %s: argument must be PID or %%jobid\n", *argv);
+            failed++;
+        }
+    }
+    qsort(ranges, nranges, sizeof(ranges[0]), range_cmp);
+    for (j = 0; j < nranges; j++)
+    {
+        if (nspans > 0 && ranges[j][0] <= spans[nspans - 1][1] + 1)
+        {
+            if (ranges[j][1] > spans[nspans - 1][1])
+                spans[nspans - 1][1] = ranges[j][1];
+        }
+        else
+        {
+            spans[nspans][0] = ranges[j][0];
+            spans[nspans][1] = ranges[j][1];
+            nspans++;
+        }
+    }
+    memset(jidset, -1, sizeof(jidset));
+    for (j = 0; j < nsingles; j++)
+        jidset[killset_slot(jidset, singles[j])] = singles[j];
+    memset(pidset, -1, sizeof(pidset));
+    for (j = 0; j < npids; j++)
+        pidset[killset_slot(pidset, pids[j])] = pids[j];
+
+    // One pass over the job list, which must not change underneath us
+    _sigemptyset(&mask);
+    _sigaddset(&mask, SIGCHLD);
+    _sigprocmask(SIG_BLOCK, &mask, &prev);
+    for (i = 0; i < MAXJOBS; i++)
+    {
+        job = &jobs[i];
+        if (job->pid == 0)
+            continue;
+        match = (running && job->state == BG) || (stopped && job->state == ST);
+
+        // The last span starting at or below the jid is the only one that can hold it
+        for (lo = 0, hi = nspans; lo < hi;)
+        {
+            j = (lo + hi) / 2;
+            if (spans[j][0] <= job->jid)
+                lo = j + 1;
+            else
+                hi = j;
+        }
+        if (lo > 0 && job->jid <= spans[lo - 1][1])
+        {
+            match = 1;
+            if (jidset[j = killset_slot(jidset, job->jid)] == job->jid)
+                jidhit[j] = 1;
+        }
+        if (pidset[j = killset_slot(pidset, job->pid)] == job->pid)
+            match = pidhit[j] = 1;
+        if (!match)
+            continue;
+
+        if (kill(-job->pid, sig) < 0)
+        {
+            printf("[%d] (%d): %s\n", job->jid, job->pid, strerror(errno));
+            failed++;
+            continue;
+        }
+        reached++;
+        if (sig == SIGCONT && job->state == ST)
+            setjobstate(job, BG); // Resumed in the background, as bg does
+    }
+
+    // Jobs named on their own that did not exist, and plain pids
+    for (j = 0; j < nsingles; j++)
+    {
+        if (!jidhit[killset_slot(jidset, singles[j])])
+        {
+            printf("%%%d: No such job\n", singles[j]);
+            failed++;
+        }
+    }
+    for (j = 0; j < npids; j++)
+    {
+        if (pidhit[killset_slot(pidset, pids[j])])
+            continue;
+        if (kill(pids[j], sig) < 0)
+        {
+            printf("(%d): No such process\n", pids[j]);
+            failed++;
+        }
+        else
+            reached++;
+    }
+
+    printf("kill: signalled %d, failed %d\n", reached, failed);
+    last_status = (failed > 0 || reached == 0);
+
+    // Only now let the reaper report the jobs we took down, so its
+    // messages do not race with ours on stdout
+    _sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * do_disown - Execute the builtin disown command: forget the given
+ *    jobs (or all of them with -a) without signalling them
+ */
+void do_disown(char **argv)
+{
+    struct job_t *job;
+    sigset_t mask, prev;
+    int i;
+
+    if (argv[1] == NULL)
+    {
+        printf("%s command requires PID or %%jobid argument\n", argv[0]);
+        last_status = 2;
+        return;
+    }
+
+    _sigemptyset(&mask);
+    _sigaddset(&mask, SIGCHLD);
+    _sigprocmask(SIG_BLOCK, &mask, &prev);
+    for (i = 1; argv[i] != NULL; i++)
+    {
+        if (!strcmp(argv[i], "-a"))
+        {
+            for (job = jobs; job < jobs + MAXJOBS; job++)
+                if (job->pid != 0)
+                    deletejob(jobs, job->pid);
+            continue;
+        }
+        if (argv[i][0] == '%')
+            job = getjobjid(jobs, atoi(&argv[i][1]));
+        else if (isdigit(argv[i][0]))
+            job = getjobpid(jobs, atoi(argv[i]));
+        else
+        {
+            printf("%s: argument must be PID or %%jobid\n", argv[0]);
+            last_status = 1;
+            continue;
+        }
+        if (job == NULL)
+        {
+            printf("%s: No such job\n", argv[i]);
+            last_status = 1;
+            continue;
+        }
+        deletejob(jobs, job->pid);
+    }
+    _sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+void do_bgfg(char **argv)
+{
+    struct job_t *job;
+    char *id;
+    int jid = 0;
+    pid_t pid;
+
+    id = argv[1];
+
+    // Invalid ID
+    if (id == NULL)
+    {
+        printf("%s command requires PID or %%jobid argument\n", argv[0]);
+        last_status = 1;
+        return;
+    }
+
+    // We will first get the job from the supplied jid or pid and then change the state later. 
+    
+    if (id[0] == '%')
+    {
+        // Here, user has supplied JID. We get the corresponding job. 
+        jid = atoi(&id[1]);
+        job = getjobjid(jobs, jid); // Getting Job
+
+        // If the job returned is NULL or the jid is 0 (no jid should be zero) - we return with error msg
+        if (job==NULL || jid==0)
+        {
+            //%2: No such job
+            printf("%s: No such job\n", id);
+            last_status = 1;
+            return;
+        }
+    }
+
+    // The other option is that user has supplied PID. We get the corresponding job. 
+    else if (isdigit(id[0]))
+    {
+        pid = atoi(id);
         job = getjobpid(jobs, pid);
-        if (WIFEXITED(status))
+
+        // Again, if job returned is NULL or pid is 0, we return with error msg. 
+        if (job==NULL || pid==0)
+        {
+            //(2): No such process
+            printf("(%d): No such process\n", pid);
+            last_status = 1;
+            return;
+        }
+    }
+
+    // The default case is that user has supplied some garbage value for the jid/pid starting without digit or %. 
+    else
+    {
+        printf("%s: argument must be PID of %%jobid\n", argv[0]);
+        last_status = 1;
+        return;
+    }
+
+    pid = job->pid;
+
+    // Resuming program when SIGCONT received
+    kill(-pid, SIGCONT);
+
+    // Now that we have the job, we can "do" fg/bg accordingly
+    if (!strcmp("fg", argv[0]))
+    {
+        // This command moves BG to FG. Change state and call waitfg. 
+        setjobstate(job, FG);
+        waitfg(job->pid);
+    }
+    else
+    {
+        // This command moves FG to BG. Change state and print that jobs is now in BG. 
+        setjobstate(job, BG);
+        printf("[%d] (%d) %s\n", job->jid, job->pid, job->cmdline);
+    }
+
+    return;
+}
+
+/*
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+void waitfg(pid_t pid)
+{
+    // First, we get the FG job
+    struct job_t *fg_job = getjobpid(jobs, pid);
+
+    if (verbose)
+        printf("Waiting FG\n");
+
+    if (pid == 0)
+    {
+        return;
+    }
+
+    // Wait until the reaper reports that the FG job finished or stopped.
+    // SIGCHLD stays blocked around the check so sigsuspend cannot miss it.
+    if (fg_job != NULL)
+    {
+        sigset_t mask, prev;
+
+        _sigemptyset(&mask);
+        _sigaddset(&mask, SIGCHLD);
+        _sigprocmask(SIG_BLOCK, &mask, &prev);
+        while (pid == fgpid(jobs))
+        {
+            waitevent(&prev);
+        }
+        _sigprocmask(SIG_SETMASK, &prev, NULL);
+    }
+    return;
+}
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/*
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.
+ */
+void sigchld_handler(int sig)
+{
+    pid_t pid;
+    struct job_t *job;
+    int status; // this status is set by the waitpid function
+
+    if (verbose)
+    {
+        printf("SIGCHLD signal recieved\n");
+    }
+
+    // Here we modify default behviour of the waitpid function.
+    // We pass an integer which gets the status of the child.
+    // The mode is set to WNOHANG|WUNTRACED - returns the pid of one of the
+    //  stopped or terminated children, 0 if none. (from textbook)
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0)
+    {
+        // Now that we have status of the child, we can either delete, or change state.
+        job = getjobpid(jobs, pid);
+
+        // The exit status of the foreground job becomes the shell's status
+        if (job != NULL && job->state == FG)
+        {
+            last_status = status2code(status);
+            fg_interrupted = !WIFEXITED(status);
+        }
+
+        // A pause by the load governor is not a stop the user should hear about
+        if (job != NULL && job->governed && WIFSTOPPED(status))
+        {
+            setjobstate(job, ST);
+            continue;
+        }
+
+        // Remember the event for the wait builtin
+        events[nevents % MAXEVENTS].pid = pid;
+        events[nevents % MAXEVENTS].jid = job != NULL ? job->jid : 0;
+        events[nevents % MAXEVENTS].status = status;
+        nevents++;
+
+        if (WIFEXITED(status))
+        {
+            // Child terminated normally. So, delete the job from the list.
+            if (verbose)
+                printf("   Child exited normally\n");
+            deletejob(jobs, pid);
+        }
+        else if (job == NULL)
+        {
+            // A disowned job: nothing to report or update
+            continue;
+        }
+        else if (WIFSIGNALED(status))
+        {
+            // Child terminated because of an uncaught signal. So, delete the job from the list.
+            // Also, according to reference solution, we must print the signal which caused the termination. (use WTERMSIG)
+            int terminator = WTERMSIG(status);
+            printf("JOB [%d] (%d) terminated by SIGNAL %d\n", pid2jid(pid), pid, terminator);
+            deletejob(jobs, pid);
+        }
+
+        else if (WIFSTOPPED(status))
+        {
+            // Child is currently stopped. No need to delete.
+            setjobstate(job, ST); // Set the state to ST (stopped)
+            // According to reference solution, we should print the Signal that caused the stop. (use WSTOPSIG)
+            int stopper = WSTOPSIG(status);
+            printf("JOB [%d] (%d) stopped by SIGNAL %d\n", pid2jid(pid), pid, stopper);
+        }
+    }
+
+    // Detect Error and print accordingly (got this part from the textbook)
+    // if (errno == ECHILD)
+    // {
+    //     unix_error("Error in WaitPID\n");
+    // }
+
+    return;
+}
+
+/*
+ * sigint_handler - The kernel sends a SIGINT to the shell whenver the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.
+ */
+void sigint_handler(int sig)
+{
+    // printf("Interrupt Signal\n");
+    nints++;
+
+    // Get the process ID and send the SIGINT signal using kill function
+    pid_t pid = fgpid(jobs);
+    if (pid != 0)
+    {
+        if (verbose)
+        {
+            printf("Terminating the foreground job\n");
+        }
+
+        kill(-pid, SIGINT);
+        rec_append(REC_SIGNAL, SIGINT, NULL, 0);
+    }
+    else
+    {
+        // Nothing to forward to: interrupt a wait builtin instead
+        int_pending = 1;
+        rec_append(REC_SIGNAL, SIGINT, NULL, 0); // Replay needs it to end the wait too
+    }
+
+    return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.
+ */
+void sigtstp_handler(int sig)
+{
+    // printf(" Suspend signal\n");
+
+    // Get the process ID and send the signal using kill function
+    pid_t pid = fgpid(jobs);
+    if (pid != 0)
+    {
+        if (verbose)
+        {
+            printf("Suspending the forground job\n");
+        }
+
+        kill(-pid, SIGTSTP);
+        rec_append(REC_SIGNAL, SIGTSTP, NULL, 0);
+
+        // No SIGCHLD will report the stop of a job that is not our child
+        if (getjobpid(jobs, pid)->adopted)
+        {
+            setjobstate(getjobpid(jobs, pid), ST);
+        }
+    }
+
+    return;
+}
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job)
+{
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->cmdline[0] = '\0';
+    job->cgroup[0] = '\0';
+    job->governed = 0;
+    job->start = 0;
+    job->adopted = 0;
+    job->pidfd = -1;
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct job_t *jobs)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+        clearjob(&jobs[i]);
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(struct job_t *jobs)
+{
+    int i, max = 0;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].jid > max)
+            max = jobs[i].jid;
+    return max;
+}
+
+/* addjob - Add a job to the job list */
+int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
+{
+    int i;
+
+    if (pid < 1)
+        return 0;
+
+    for (i = 0; i < MAXJOBS; i++)
+    {
+        if (jobs[i].pid == 0)
+        {
+            jobs[i].pid = pid;
+            jobs[i].state = state;
+            jobs[i].jid = nextjid++;
+            if (nextjid > MAXJOBS)
+                nextjid = 1;
+            strcpy(jobs[i].cmdline, cmdline);
+            if (verbose)
+            {
+                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+            }
+            if (statefd >= 0)
+            {
+                jobs[i].start = proc_starttime(pid, NULL);
+                state_log('+', &jobs[i]);
+            }
+            return 1;
+        }
+    }
+    printf("Tried to create too many jobs\n");
+    return 0;
+}
+
+/* deletejob - Delete a job whose PID=pid from the job list */
+int deletejob(struct job_t *jobs, pid_t pid)
+{
+    int i;
+
+    if (pid < 1)
+        return 0;
+
+    for (i = 0; i < MAXJOBS; i++)
+    {
+        if (jobs[i].pid == pid)
+        {
+            if (jobs[i].cgroup[0] != '\0')
+                rmdir(jobs[i].cgroup); /* the job's cgroup is empty now */
+            if (jobs[i].pidfd >= 0)
+                close(jobs[i].pidfd);
+            state_log('-', &jobs[i]);
+            clearjob(&jobs[i]);
+            nextjid = maxjid(jobs) + 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct job_t *jobs)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].state == FG)
+            return jobs[i].pid;
+    return 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t *getjobpid(struct job_t *jobs, pid_t pid)
+{
+    int i;
+
+    if (pid < 1)
+        return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].pid == pid)
+            return &jobs[i];
+    return NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct job_t *jobs, int jid)
+{
+    int i;
+
+    if (jid < 1)
+        return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].jid == jid)
+            return &jobs[i];
+    return NULL;
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid)
+{
+    int i;
+
+    if (pid < 1)
+        return 0;
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].pid == pid)
+        {
+            return jobs[i].jid;
+        }
+    return 0;
+}
+
+/* listjobs - Print the job list */
+void listjobs(struct job_t *jobs)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+    {
+        if (jobs[i].pid != 0)
+        {
+            printjob(&jobs[i]);
+        }
+    }
+}
+
+/* setjobstate - Change the state of a job and note it in the state log */
+void setjobstate(struct job_t *job, int state)
+{
+    if (state != ST)
+        job->governed = 0; // Resumed, by the governor or by fg/bg
+    job->state = state;
+    state_log('=', job);
+}
+
+/* printjob - Print one line of the job list */
+void printjob(struct job_t *job)
+{
+    printf("[%d] (%d) ", job->jid, job->pid);
+    switch (job->state)
+    {
+    case BG:
+        printf("Running ");
+        break;
+    case FG:
+        printf("Foreground ");
+        break;
+    case ST:
+        printf(job->governed ? "Stopped (governor) " : "Stopped ");
+        break;
+    default:
+        printf("listjobs: Internal error: job[%d].state=%d ",
+               job->jid, job->state);
+    }
+    printf("%s", job->cmdline);
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+/*********************************************
+ * Helper routines that manage the environment
+ *********************************************/
+
+/*
+ * The environment is copied out of environ into an open-addressed hash
+ * table the first time it changes. env_envp returns a cached envp array
+ * that is only rebuilt after a change, so launching a job does not
+ * allocate. Until then environ itself is handed to execve. The shell
+ * calls it before every fork, so the rebuild happens once in the parent
+ * and the child execs with the cached array (unless a VAR=value prefix
+ * changes the child's own copy).
+ */
+
+/* ENV_DELETED - marks a slot whose entry was removed */
+static char env_deleted[] = "";
+#define ENV_DELETED env_deleted
+
+/* env_hash - FNV-1a hash of the first len characters of name */
+unsigned int env_hash(const char *name, int len)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* env_init - Load environ into the table, if not done already */
+void env_init(void)
+{
+    char **ep;
+
+    if (env.size != 0)
+        return;
+
+    env.size = ENVSLOTS;
+    env.slots = calloc(env.size, sizeof(char *));
+    if (env.slots == NULL)
+        unix_error("calloc error");
+    env.dirty = 1;
+    for (ep = environ; *ep != NULL; ep++)
+        if (strchr(*ep, '=') != NULL)
+            env_put(*ep);
+}
+
+/*
+ * env_lookup - Return the slot holding variable name (its first len
+ *    characters), or the free slot where it should be inserted
+ */
+int env_lookup(const char *name, int len)
+{
+    unsigned int mask = env.size - 1;
+    unsigned int i = env_hash(name, len) & mask;
+    int freeslot = -1;
+
+    while (env.slots[i] != NULL)
+    {
+        if (env.slots[i] == ENV_DELETED)
+        {
+            if (freeslot < 0)
+                freeslot = i;
+        }
+        else if (!strncmp(env.slots[i], name, len) && env.slots[i][len] == '=')
+        {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return freeslot >= 0 ? freeslot : (int)i;
+}
+
+/* env_grow - Rehash the table, doubling it if it is mostly live entries */
+void env_grow(void)
+{
+    char **old = env.slots;
+    int oldsize = env.size;
+    int i;
+
+    if (env.count * 2 >= env.size)
+        env.size *= 2;
+    env.slots = calloc(env.size, sizeof(char *));
+    if (env.slots == NULL)
+        unix_error("calloc error");
+    env.used = env.count;
+    for (i = 0; i < oldsize; i++)
+        if (old[i] != NULL && old[i] != ENV_DELETED)
+            env.slots[env_lookup(old[i], strchr(old[i], '=') - old[i])] = old[i];
+    free(old);
+}
+
+/* env_put - Set a variable from a "NAME=value" assignment */
+void env_put(const char *assign)
+{
+    int len = strchr(assign, '=') - assign;
+    char *entry;
+    int i;
+
+    env_init();
+    if ((entry = strdup(assign)) == NULL)
+        unix_error("strdup error");
+
+    if ((env.used + 1) * 4 > env.size * 3)
+        env_grow();
+    i = env_lookup(assign, len);
+    if (env.slots[i] == NULL || env.slots[i] == ENV_DELETED)
+    {
+        if (env.slots[i] == NULL)
+            env.used++;
+        env.count++;
+    }
+    else
+    {
+        free(env.slots[i]);
+    }
+    env.slots[i] = entry;
+    env.dirty = 1;
+}
+
+/* env_unset - Remove a variable, if it is set */
+void env_unset(const char *name)
+{
+    int i;
+
+    env_init();
+    i = env_lookup(name, strlen(name));
+    if (env.slots[i] == NULL || env.slots[i] == ENV_DELETED)
+        return;
+    free(env.slots[i]);
+    env.slots[i] = ENV_DELETED;
+    env.count--;
+    env.dirty = 1;
+}
+
+/* env_envp - Return the environment as an envp array for execve */
+char **env_envp(void)
+{
+    int i, n = 0;
+
+    if (env.size == 0)
+        return environ;
+    if (!env.dirty)
+        return env.envp;
+
+    if (env.count + 1 > env.envcap)
+    {
+        env.envcap = env.count * 2 + 1;
+        if ((env.envp = realloc(env.envp, env.envcap * sizeof(char *))) == NULL)
+            unix_error("realloc error");
+    }
+    for (i = 0; i < env.size; i++)
+        if (env.slots[i] != NULL && env.slots[i] != ENV_DELETED)
+            env.envp[n++] = env.slots[i];
+    env.envp[n] = NULL;
+    env.dirty = 0;
+    return env.envp;
+}
+
+/* env_get - Return the value of a variable, or NULL if it is not set */
+char *env_get(const char *name)
+{
+    int len = strlen(name);
+    int i;
+
+    if (env.size == 0)
+        return getenv(name);
+    i = env_lookup(name, len);
+    if (env.slots[i] == NULL || env.slots[i] == ENV_DELETED)
+        return NULL;
+    return env.slots[i] + len + 1;
+}
+
+/* isassign - Return true if word has the form NAME=value */
+int isassign(const char *word)
+{
+    if (!isalpha(*word) && *word != '_')
+        return 0;
+    while (isalnum(*word) || *word == '_')
+        word++;
+    return *word == '=';
+}
+
+/* skipassign - Return the first word of argv that is not an assignment */
+char **skipassign(char **argv)
+{
+    while (*argv != NULL && isassign(*argv))
+        argv++;
+    return argv;
+}
+/*************************************
+ * end environment helper routines
+ *************************************/
+
+/*********************************************
+ * Helper routines for job resource limits
+ *********************************************/
+
+/*
+ * Limits are applied with prlimit in the child between fork and exec.
+ * When a writable cgroup v2 hierarchy exists (the shell's own cgroup,
+ * or $TSH_CGROUP), a job launched with limits also gets its own cgroup
+ * with memory.max, cpu.max and pids.max, which jobs -l reads back.
+ * Without one the rlimits still apply and usage comes from /proc.
+ *
+ * cgroup v2 only lets a cgroup with no processes of its own enable
+ * controllers for its children. With its own cgroup, the shell first
+ * moves itself and its jobs into a tsh-shell-<pid> leaf, which works
+ * when nothing else runs there (e.g. under systemd-run --scope -p
+ * Delegate=yes). $TSH_CGROUP must name a delegated, empty cgroup.
+ */
+
+/* Names accepted by the limit builtin, in the order limit prints them */
+static const char *limitnames[] = {"mem", "cpu", "nofile", "nproc", "cpus", NULL};
+
+/*
+ * do_limit - Execute the builtin limit command. With no arguments
+ *    print the default limits, otherwise set them from name=value
+ */
+void do_limit(char **argv)
+{
+    struct limits_t lim = deflimits;
+    rlim_t vals[4];
+    char **rest;
+    int i;
+
+    if (argv[1] == NULL)
+    {
+        vals[0] = deflimits.mem;
+        vals[1] = deflimits.cpu;
+        vals[2] = deflimits.nofile;
+        vals[3] = deflimits.nproc;
+        for (i = 0; i < 4; i++)
+        {
+            if (vals[i] == RLIM_INFINITY)
+                printf("%-8s unlimited\n", limitnames[i]);
+            else
+                printf("%-8s %llu\n", limitnames[i], (unsigned long long)vals[i]);
+        }
+        if (deflimits.cpus == 0)
+            printf("%-8s unlimited\n", limitnames[4]);
+        else
+            printf("%-8s %g\n", limitnames[4], deflimits.cpus);
+        return;
+    }
+
+    if ((rest = parselimits(argv + 1, &lim)) == NULL)
+    {
+        last_status = 1;
+        return;
+    }
+    if (*rest != NULL)
+    {
+        printf("limit: unknown resource: %s\n", *rest);
+        last_status = 1;
+        return;
+    }
+    deflimits = lim;
+}
+
+/*
+ * parselimits - Apply name=value limit settings from argv to lim.
+ *    Sizes take a K, M or G suffix and "unlimited" clears a limit.
+ *    Returns the first word that is not a limit setting, or NULL
+ *    after printing a message if a value is malformed.
+ */
+char **parselimits(char **argv, struct limits_t *lim)
+{
+    char *eq, *end;
+    unsigned long long val;
+    double cpus = 0;
+    int i, len;
+
+    for (; *argv != NULL; argv++)
+    {
+        if ((eq = strchr(*argv, '=')) == NULL)
+            return argv;
+        len = eq - *argv;
+        for (i = 0; limitnames[i] != NULL; i++)
+            if ((int)strlen(limitnames[i]) == len && !strncmp(*argv, limitnames[i], len))
+                break;
+        if (limitnames[i] == NULL)
+            return argv;
+
+        if (!strcmp(eq + 1, "unlimited"))
+        {
+            val = RLIM_INFINITY;
+            cpus = 0;
+        }
+        else if (i == 4)
+        {
+            cpus = strtod(eq + 1, &end);
+            if (end == eq + 1 || *end != '\0' || cpus <= 0)
+            {
+                printf("limit: bad value: %s\n", *argv);
+                return NULL;
+            }
+        }
+        else
+        {
+            errno = 0;
+            val = strtoull(eq + 1, &end, 10);
+            if (*end == 'K' || *end == 'k')
+                val <<= 10, end++;
+            else if (*end == 'M' || *end == 'm')
+                val <<= 20, end++;
+            else if (*end == 'G' || *end == 'g')
+                val <<= 30, end++;
+            if (end == eq + 1 || *end != '\0' || errno != 0)
+            {
+                printf("limit: bad value: %s\n", *argv);
+                return NULL;
+            }
+        }
+
+        switch (i)
+        {
+        case 0:
+            lim->mem = val;
+            break;
+        case 1:
+            lim->cpu = val;
+            break;
+        case 2:
+            lim->nofile = val;
+            break;
+        case 3:
+            lim->nproc = val;
+            break;
+        default:
+            lim->cpus = cpus;
+        }
+    }
+    return argv;
+}
+
+/* haslimits - Return true if lim restricts anything */
+int haslimits(struct limits_t *lim)
+{
+    return lim->mem != RLIM_INFINITY || lim->cpu != RLIM_INFINITY ||
+           lim->nofile != RLIM_INFINITY || lim->nproc != RLIM_INFINITY || lim->cpus != 0;
+}
+
+/*
+ * apply_limits - Called in the child before exec: join the job's cgroup
+ *    (if it has one) and set the rlimits. Exits if a limit is refused.
+ */
+void apply_limits(struct limits_t *lim, char *cgroup)
+{
+    static const int resources[] = {RLIMIT_AS, RLIMIT_CPU, RLIMIT_NOFILE, RLIMIT_NPROC};
+    rlim_t vals[4];
+    struct rlimit rl;
+    int i;
+
+    if (cgroup[0] != '\0')
+        cg_write(cgroup, "cgroup.procs", "0");
+
+    vals[0] = lim->mem;
+    vals[1] = lim->cpu;
+    vals[2] = lim->nofile;
+    vals[3] = lim->nproc;
+    for (i = 0; i < 4; i++)
+    {
+        if (vals[i] == RLIM_INFINITY)
+            continue;
+        rl.rlim_cur = rl.rlim_max = vals[i];
+        if (prlimit(0, resources[i], &rl, NULL) < 0)
+        {
+            printf("limit: %s: %s\n", limitnames[i], strerror(errno));
+            fflush(stdout);
+            _exit(1); // Like exec_inplace, leave the shell's script offset alone
+        }
+    }
+}
+
+/*
+ * cg_init - Find the directory that job cgroups are created under.
+ *    Returns true if there is a writable cgroup v2 hierarchy.
+ */
+int cg_init(void)
+{
+    static const char *mounts[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified", NULL};
+    char line[MAXPATH], path[MAXPATH];
+    char *dir;
+    FILE *fp;
+    int i;
+
+    if (cgready)
+        return cgroot[0] != '\0';
+    cgready = 1;
+
+    if ((dir = env_get("TSH_CGROUP")) != NULL)
+    {
+        snprintf(cgroot, sizeof(cgroot), "%s", dir);
+    }
+    else
+    {
+        /* The v2 entry of /proc/self/cgroup looks like "0::/path" */
+        path[0] = '\0';
+        if ((fp = fopen("/proc/self/cgroup", "r")) != NULL)
+        {
+            while (fgets(line, MAXPATH, fp) != NULL)
+            {
+                if (!strncmp(line, "0::", 3))
+                {
+                    line[strcspn(line, "\n")] = '\0';
+                    snprintf(path, MAXPATH, "%s", line + 3);
+                }
+            }
+            fclose(fp);
+        }
+        for (i = 0; mounts[i] != NULL; i++)
+        {
+            snprintf(line, MAXPATH, "%s/cgroup.controllers", mounts[i]);
+            if (access(line, R_OK) == 0)
+                break;
+        }
+        if (mounts[i] == NULL)
+            return 0;
+        snprintf(cgroot, sizeof(cgroot), "%s%s", mounts[i], strcmp(path, "/") ? path : "");
+    }
+
+    if (access(cgroot, W_OK) < 0)
+    {
+        cgroot[0] = '\0';
+        return 0;
+    }
+    if (dir == NULL)
+    {
+        cg_leave();
+    }
+
+    /* Let job cgroups use the controllers; each may fail independently */
+    cg_write(cgroot, "cgroup.subtree_control", "+memory");
+    cg_write(cgroot, "cgroup.subtree_control", "+cpu");
+    cg_write(cgroot, "cgroup.subtree_control", "+pids");
+    return 1;
+}
+
+/*
+ * cg_leave - Move the shell and its jobs out of cgroot into a leaf
+ *    cgroup, so that cgroot can enable controllers for job cgroups.
+ *    Leaves of shells that have exited are removed on the way.
+ */
+void cg_leave(void)
+{
+    char leaf[2 * MAXPATH], pid[32];
+    struct dirent *de;
+    DIR *dp;
+    int i;
+
+    if ((dp = opendir(cgroot)) != NULL)
+    {
+        while ((de = readdir(dp)) != NULL)
+        {
+            if (!strncmp(de->d_name, "tsh-shell-", 10))
+            {
+                snprintf(leaf, sizeof(leaf), "%s/%s", cgroot, de->d_name);
+                rmdir(leaf); // Fails while a live shell is in it
+            }
+        }
+        closedir(dp);
+    }
+
+    snprintf(leaf, sizeof(leaf), "%s/tsh-shell-%d", cgroot, (int)getpid());
+    if (mkdir(leaf, 0755) < 0 && errno != EEXIST)
+        return;
+    cg_write(leaf, "cgroup.procs", "0");
+    for (i = 0; i < MAXJOBS; i++)
+    {
+        if (jobs[i].pid != 0 && jobs[i].cgroup[0] == '\0')
+        {
+            sprintf(pid, "%d", (int)jobs[i].pid);
+            cg_write(leaf, "cgroup.procs", pid);
+        }
+    }
+}
+
+/* cg_write - Write value to a cgroup control file, return 0 on success */
+int cg_write(char *dir, char *file, char *value)
+{
+    char path[MAXPATH + 32];
+    int fd, len = strlen(value), rc;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if ((fd = open(path, O_WRONLY)) < 0)
+        return -1;
+    rc = write(fd, value, len) == len ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+/*
+ * cg_create - Create a cgroup for a job launched with lim and write
+ *    its limits. Leaves the directory in cgroup, or "" if the job
+ *    gets none. If the controllers cannot be used, cgroups are not
+ *    tried again and jobs fall back to rlimits alone.
+ */
+int cg_create(struct limits_t *lim, char *cgroup)
+{
+    char val[64];
+    int ok = 1;
+
+    cgroup[0] = '\0';
+    if (!haslimits(lim) || !cg_init())
+        return 0;
+
+    snprintf(cgroup, MAXPATH, "%s/tsh-%d-%d", cgroot, (int)getpid(), cgnext++);
+    if (mkdir(cgroup, 0755) < 0)
+    {
+        cgroup[0] = '\0';
+        return 0;
+    }
+
+    if (lim->mem != RLIM_INFINITY)
+    {
+        sprintf(val, "%llu", (unsigned long long)lim->mem);
+        ok = ok && cg_write(cgroup, "memory.max", val) == 0;
+    }
+    if (lim->cpus != 0)
+    {
+        sprintf(val, "%ld 100000", (long)(lim->cpus * 100000));
+        ok = ok && cg_write(cgroup, "cpu.max", val) == 0;
+    }
+    if (lim->nproc != RLIM_INFINITY)
+    {
+        sprintf(val, "%llu", (unsigned long long)lim->nproc);
+        ok = ok && cg_write(cgroup, "pids.max", val) == 0;
+    }
+
+    if (!ok)
+    {
+        if (verbose)
+            printf("cgroup controllers unavailable, using rlimits only\n");
+        rmdir(cgroup);
+        cgroup[0] = '\0';
+        cgroot[0] = '\0';
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * printusage - Print the resource usage of a job for jobs -l, from
+ *    its cgroup if it has one, otherwise from /proc/<pid>/stat
+ */
+void printusage(struct job_t *job)
+{
+    char path[MAXPATH + 32], buf[MAXLINE];
+    unsigned long long mem = 0, usec = 0, pids = 0, utime = 0, stime = 0;
+    long rss = 0;
+    char *p;
+    FILE *fp;
+    int i;
+
+    if (job->cgroup[0] != '\0')
+    {
+        snprintf(path, sizeof(path), "%s/memory.current", job->cgroup);
+        if ((fp = fopen(path, "r")) != NULL)
+        {
+            if (fscanf(fp, "%llu", &mem) != 1)
+                mem = 0;
+            fclose(fp);
+        }
+        snprintf(path, sizeof(path), "%s/cpu.stat", job->cgroup);
+        if ((fp = fopen(path, "r")) != NULL)
+        {
+            while (fgets(buf, MAXLINE, fp) != NULL)
+                if (sscanf(buf, "usage_usec %llu", &usec) == 1)
+                    break;
+            fclose(fp);
+        }
+        snprintf(path, sizeof(path), "%s/pids.current", job->cgroup);
+        if ((fp = fopen(path, "r")) != NULL)
+        {
+            if (fscanf(fp, "%llu", &pids) != 1)
+                pids = 0;
+            fclose(fp);
+        }
+        printf("    mem %lluK cpu %.2fs pids %llu (cgroup)\n", mem >> 10, usec / 1e6, pids);
+        return;
+    }
+
+    /* Counting spaces from the ")" that ends the command name: utime
+     * (field 14) follows the 12th and rss (field 24) the 22nd */
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)job->pid);
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        printf("    usage unavailable\n");
+        return;
+    }
+    if (fgets(buf, MAXLINE, fp) != NULL && (p = strrchr(buf, ')')) != NULL)
+    {
+        for (i = 0; i < 12 && p != NULL; i++)
+            p = strchr(p + 1, ' ');
+        if (p == NULL || sscanf(p, " %llu %llu", &utime, &stime) != 2)
+            utime = stime = 0;
+        for (i = 0; i < 10 && p != NULL; i++)
+            p = strchr(p + 1, ' ');
+        if (p == NULL || sscanf(p, " %ld", &rss) != 1)
+            rss = 0;
+    }
+    fclose(fp);
+    printf("    rss %ldK cpu %.2fs (proc)\n", rss * (sysconf(_SC_PAGESIZE) >> 10),
+           (double)(utime + stime) / sysconf(_SC_CLK_TCK));
+}
+/*************************************
+ * end resource limit helper routines
+ *************************************/
+
+/********************************************
+ * Helper routines for session record/replay
+ ********************************************/
+
+/*
+ * With -R every command line, the end of its evaluation and every
+ * signal forwarded to a foreground job is appended to a binary log.
+ * Records collect in recbuf and are written out only when it fills
+ * up and at exit, so recording costs a memcpy per event.
+ */
+
+/* elapsed - Return the nanoseconds of monotonic time since since */
+uint64_t elapsed(struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000000 + now.tv_nsec - since->tv_nsec;
+}
+
+/* rec_open - Start recording the session to path */
+void rec_open(char *path)
+{
+    if ((recfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        unix_error("open error");
+    recpid = getpid();
+    clock_gettime(CLOCK_MONOTONIC, &recstart);
+    memcpy(recbuf, RECMAGIC, strlen(RECMAGIC));
+    reclen = strlen(RECMAGIC);
+    atexit(rec_flush);
+}
+
+/*
+ * rec_append - Add a record to the session log. The signal handlers
+ *    append too, so SIGINT and SIGTSTP are blocked while recbuf changes.
+ */
+void rec_append(int type, int arg, const char *data, int len)
+{
+    uint64_t ns;
+    uint16_t len16;
+    sigset_t mask, prev;
+
+    if (recfd < 0)
+        return;
+    if (len > MAXLINE)
+        len = MAXLINE;
+
+    _sigemptyset(&mask);
+    _sigaddset(&mask, SIGINT);
+    _sigaddset(&mask, SIGTSTP);
+    _sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    if (reclen + RECHDR + len > RECBUF)
+        rec_flush();
+    ns = elapsed(&recstart);
+    len16 = len;
+    memcpy(recbuf + reclen, &ns, 8);
+    memcpy(recbuf + reclen + 8, &len16, 2);
+    recbuf[reclen + 10] = type;
+    recbuf[reclen + 11] = arg;
+    memcpy(recbuf + reclen + RECHDR, data, len);
+    reclen += RECHDR + len;
+
+    _sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* rec_flush - Write the buffered records; only the recording shell does */
+void rec_flush(void)
+{
+    int n, done = 0;
+
+    if (recfd < 0 || getpid() != recpid)
+        return;
+    while (done < reclen)
+    {
+        if ((n = write(recfd, recbuf + done, reclen - done)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        done += n;
+    }
+    reclen = 0;
+}
+
+/* loadlog - Read a whole session log into memory and check its magic */
+char *loadlog(char *path, size_t *size)
+{
+    struct stat st;
+    char *log;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+        unix_error(path);
+    if ((log = malloc(st.st_size + 1)) == NULL)
+        unix_error("malloc error");
+    if (read(fd, log, st.st_size) != st.st_size)
+        unix_error("read error");
+    close(fd);
+    if (st.st_size < (off_t)strlen(RECMAGIC) || memcmp(log, RECMAGIC, strlen(RECMAGIC)))
+        app_error("not a tsh session log");
+    *size = st.st_size;
+    return log;
+}
+
+/* recns - Return the time of the record at p */
+uint64_t recns(char *p)
+{
+    uint64_t ns;
+
+    memcpy(&ns, p, 8);
+    return ns;
+}
+
+/* recsize - Return the payload length of the record at p */
+int recsize(char *p)
+{
+    uint16_t len;
+
+    memcpy(&len, p + 8, 2);
+    return len;
+}
+
+/* Type and argument of the record at p */
+#define RECTYPE(p) ((p)[10])
+#define RECARG(p) ((p)[11])
+
+/*
+ * replay - Run the command lines of a session log through eval,
+ *    waiting out the recorded pauses unless fast is set, then print
+ *    each command's recorded and replayed latency and exit. A quit
+ *    line ends the replay at that point. Signals
+ *    are delivered at their recorded offset into their command, by a
+ *    timer whose handler calls the same handlers as a real ctrl-c/z.
+ */
+void replay(char *path, int fast)
+{
+    char line[MAXLINE + 1], *argv[MAXARGS];
+    char *log, *p, *q, *end;
+    uint64_t *recorded, *replayed, t, total_rec = 0, total_new = 0;
+    struct timespec wake;
+    size_t size;
+    int n = 0, max = 64, len, i;
+
+    log = loadlog(path, &size);
+    end = log + size;
+    recorded = malloc(max * sizeof(uint64_t));
+    replayed = malloc(max * sizeof(uint64_t));
+    if (recorded == NULL || replayed == NULL)
+        unix_error("malloc error");
+    Signal(SIGALRM, replay_alarm);
+    clock_gettime(CLOCK_MONOTONIC, &recstart);
+
+    for (p = log + strlen(RECMAGIC); p + RECHDR <= end; p += RECHDR + recsize(p))
+    {
+        if (RECTYPE(p) != REC_INPUT)
+            continue;
+        len = recsize(p);
+        if (p + RECHDR + len > end)
+            break;
+        memcpy(line, p + RECHDR, len);
+        line[len] = '\0';
+
+        /* quit would exit before the report, so it ends the replay */
+        if (len > 0 && parseline(line, argv) >= 0 && argv[0] != NULL && !strcmp(argv[0], "quit"))
+            break;
+
+        /* Find the command's signals and the record that ends it */
+        for (q = p + RECHDR + len; q + RECHDR <= end && RECTYPE(q) == REC_SIGNAL; q += RECHDR + recsize(q))
+            ;
+        if (n == max)
+        {
+            max *= 2;
+            recorded = realloc(recorded, max * sizeof(uint64_t));
+            replayed = realloc(replayed, max * sizeof(uint64_t));
+            if (recorded == NULL || replayed == NULL)
+                unix_error("realloc error");
+        }
+        recorded[n] = (q + RECHDR <= end && RECTYPE(q) == REC_DONE) ? recns(q) - recns(p) : 0;
+
+        if (!fast)
+        {
+            t = recns(p);
+            wake.tv_sec = recstart.tv_sec + (recstart.tv_nsec + t % 1000000000) / 1000000000 + t / 1000000000;
+            wake.tv_nsec = (recstart.tv_nsec + t % 1000000000) % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+                ;
+        }
+
+        rpbase = recns(p);
+        rpend = q;
+        rpsigs = p + RECHDR + len < q ? p + RECHDR + len : NULL;
+        clock_gettime(CLOCK_MONOTONIC, &rpstart);
+        replay_arm();
+        eval(line);
+        fflush(stdout);
+        replayed[n] = elapsed(&rpstart);
+        rpsigs = NULL;
+        setitimer(ITIMER_REAL, &(struct itimerval){{0, 0}, {0, 0}}, NULL);
+        n++;
+    }
+
+    printf("%-5s %12s %12s %12s  %s\n", "#", "recorded ms", "replayed ms", "diff ms", "command");
+    for (i = 0, p = log + strlen(RECMAGIC); i < n && p + RECHDR <= end; p += RECHDR + recsize(p))
+    {
+        if (RECTYPE(p) != REC_INPUT)
+            continue;
+        len = recsize(p);
+        if (len > 0 && p[RECHDR + len - 1] == '\n')
+            len--;
+        printf("%-5d %12.3f %12.3f %+12.3f  %.*s\n", i + 1, recorded[i] / 1e6, replayed[i] / 1e6,
+               ((double)replayed[i] - recorded[i]) / 1e6, len, p + RECHDR);
+        total_rec += recorded[i];
+        total_new += replayed[i];
+        i++;
+    }
+    printf("%-5s %12.3f %12.3f %+12.3f\n", "total", total_rec / 1e6, total_new / 1e6,
+           ((double)total_new - total_rec) / 1e6);
+    fflush(stdout);
+    exit(0);
+}
+
+/* replay_arm - Start the timer for the next signal of the replayed command */
+void replay_arm(void)
+{
+    struct itimerval it = {{0, 0}, {0, 0}};
+    uint64_t due, now;
+
+    if (rpsigs == NULL)
+        return;
+    due = recns(rpsigs) - rpbase;
+    now = elapsed(&rpstart);
+    due = due > now ? due - now : 1000; /* overdue: deliver right away */
+    it.it_value.tv_sec = due / 1000000000;
+    it.it_value.tv_usec = (due % 1000000000) / 1000;
+    if (it.it_value.tv_sec == 0 && it.it_value.tv_usec == 0)
+        it.it_value.tv_usec = 1;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/*
+ * replay_alarm - Deliver the next recorded signal as if it had been
+ *    typed at the keyboard, and arm the timer for the one after it
+ */
+void replay_alarm(int sig)
+{
+    if (rpsigs == NULL)
+        return;
+    if (RECARG(rpsigs) == SIGINT)
+        sigint_handler(SIGINT);
+    else if (RECARG(rpsigs) == SIGTSTP)
+        sigtstp_handler(SIGTSTP);
+    rpsigs += RECHDR + recsize(rpsigs);
+    if (rpsigs >= rpend)
+        rpsigs = NULL;
+    replay_arm();
+}
+
+/*
+ * totrace - Print a session log in the trace format of sdriver.pl.
+ *    The driver only sleeps whole seconds, so pauses are rounded.
+ */
+void totrace(char *path)
+{
+    char *log, *p, *end;
+    uint64_t prev = 0;
+    size_t size;
+    int secs, len;
+
+    log = loadlog(path, &size);
+    end = log + size;
+    printf("#\n# trace generated from session log %s\n#\n", path);
+    for (p = log + strlen(RECMAGIC); p + RECHDR <= end; p += RECHDR + recsize(p))
+    {
+        if (RECTYPE(p) == REC_DONE)
+            continue;
+        secs = (recns(p) - prev + 500000000) / 1000000000;
+        if (secs > 0)
+            printf("SLEEP %d\n", secs);
+        prev = recns(p);
+
+        if (RECTYPE(p) == REC_SIGNAL)
+        {
+            printf("%s\n", RECARG(p) == SIGINT ? "INT" : "TSTP");
+            continue;
+        }
+        len = recsize(p);
+        if (p + RECHDR + len > end)
+            break;
+        if (len > 0 && p[RECHDR + len - 1] == '\n')
+            len--;
+        printf("%.*s\n", len, p + RECHDR);
+    }
+    free(log);
+}
+/****************************************
+ * end session record/replay routines
+ ****************************************/
+
+/*******************************************
+ * Helper routines for the job state file
+ *******************************************/
+
+/*
+ * With -S every change to the job list is appended to a state file as
+ * one line: "+ jid pid start state cmdline" when a job is added,
+ * "= pid state" when its state changes and "- pid" when it goes away.
+ * Appends are plain writes, never synced, and once the file holds
+ * STATEMAX records it is rewritten with just the live jobs. A shell
+ * started with the same file re-adopts jobs whose pid still belongs to
+ * a process with the recorded start time, keeping their jids and
+ * command lines. They are not our children, so their exit is noticed
+ * through a pidfd (or by polling the pid) instead of SIGCHLD.
+ */
+
+/* state_open - Re-adopt the live jobs recorded in path and keep logging to it */
+void state_open(char *path)
+{
+    struct job_t *job;
+    char line[MAXLINE + 64], pstate;
+    unsigned long long start;
+    int jid, pid, state, n, i;
+    FILE *fp;
+
+    snprintf(statepath, MAXPATH, "%s", path);
+    if ((fp = fopen(path, "r")) != NULL)
+    {
+        // Replay the log into the (still empty) job list
+        while (fgets(line, sizeof(line), fp) != NULL)
+        {
+            if (line[0] == '+' && sscanf(line, "+ %d %d %llu %d %n", &jid, &pid, &start, &state, &n) == 4)
+            {
+                // A jid that is not positive, or one another job holds, is not ours
+                if (jid < 1 || pid <= 0)
+                    continue;
+                if ((job = getjobjid(jobs, jid)) != NULL && job->pid != pid)
+                    continue;
+                job = getjobpid(jobs, pid);
+                for (i = 0; job == NULL && i < MAXJOBS; i++)
+                    if (jobs[i].pid == 0)
+                        job = &jobs[i];
+                if (job == NULL)
+                    continue;
+                job->pid = pid;
+                job->jid = jid;
+                job->start = start;
+                job->state = state;
+                snprintf(job->cmdline, MAXLINE, "%s", line + n);
+            }
+            else if (line[0] == '=' && sscanf(line, "= %d %d", &pid, &state) == 2)
+            {
+                if ((job = getjobpid(jobs, pid)) != NULL)
+                    job->state = state;
+            }
+            else if (line[0] == '-' && sscanf(line, "- %d", &pid) == 1)
+            {
+                if ((job = getjobpid(jobs, pid)) != NULL)
+                    clearjob(job);
+            }
+        }
+        fclose(fp);
+
+        // Keep the jobs whose process is still the one that was recorded
+        for (job = jobs; job < jobs + MAXJOBS; job++)
+        {
+            if (job->pid == 0)
+                continue;
+            // A zombie or dying process has already finished as far as we care
+            if (job->start == 0 || proc_starttime(job->pid, &pstate) != job->start ||
+                pstate == 'Z' || pstate == 'X')
+            {
+                clearjob(job);
+                continue;
+            }
+            job->adopted = 1;
+            job->pidfd = openpidfd(job->pid);
+            job->state = pstate == 'T' ? ST : BG;
+            printf("[%d] (%d) Adopted %s", job->jid, job->pid, job->cmdline);
+        }
+        nextjid = maxjid(jobs) + 1;
+    }
+
+    state_compact();
+}
+
+/* state_log - Append one change of job to the state file */
+void state_log(char op, struct job_t *job)
+{
+    char buf[MAXLINE + 64];
+    int len;
+
+    if (statefd < 0)
+        return;
+    if (op == '+')
+        len = snprintf(buf, sizeof(buf), "+ %d %d %llu %d %.*s\n", job->jid, (int)job->pid,
+                       job->start, job->state, (int)strcspn(job->cmdline, "\n"), job->cmdline);
+    else if (op == '=')
+        len = snprintf(buf, sizeof(buf), "= %d %d\n", (int)job->pid, job->state);
+    else
+        len = snprintf(buf, sizeof(buf), "- %d\n", (int)job->pid);
+    if (len > (int)sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    if (write(statefd, buf, len) < 0 && verbose)
+        printf("state file write error: %s\n", strerror(errno));
+
+    // Compact from the main program only, where SIGCHLD is blocked around addjob
+    if (++staterecs > STATEMAX && op == '+')
+        state_compact();
+}
+
+/*
+ * state_compact - Replace the state file with one "+" record per live
+ *    job. The new file is written beside it and renamed into place.
+ */
+void state_compact(void)
+{
+    char tmp[MAXPATH + 8];
+    int i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", statepath);
+    if (statefd >= 0)
+        close(statefd);
+    if ((statefd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0)
+    {
+        printf("%s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    staterecs = 0;
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].pid != 0)
+            state_log('+', &jobs[i]);
+    if (rename(tmp, statepath) < 0)
+    {
+        printf("%s: %s\n", statepath, strerror(errno));
+        close(statefd);
+        statefd = -1;
+    }
+}
+
+/*
+ * proc_starttime - Return the start time of process pid from
+ *    /proc/<pid>/stat (0 if it does not exist), and its state letter
+ *    in *state if state is not NULL
+ */
+unsigned long long proc_starttime(pid_t pid, char *state)
+{
+    char path[64], buf[MAXLINE];
+    unsigned long long start = 0;
+    char *p;
+    FILE *fp;
+    int i;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+    if (fgets(buf, MAXLINE, fp) != NULL && (p = strrchr(buf, ')')) != NULL)
+    {
+        if (state != NULL)
+            *state = p[2];
+        /* starttime (field 22) follows the 20th space after the ")" */
+        for (i = 0; i < 20 && p != NULL; i++)
+            p = strchr(p + 1, ' ');
+        if (p == NULL || sscanf(p, " %llu", &start) != 1)
+            start = 0;
+    }
+    fclose(fp);
+    return start;
+}
+
+/* openpidfd - Return a pidfd for pid, or -1 where the kernel has none */
+int openpidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/* reap_adopted - Remove the adopted jobs whose process has exited */
+void reap_adopted(void)
+{
+    struct pollfd pfd;
+    struct job_t *job;
+    sigset_t mask, prev;
+    int gone;
+
+    _sigemptyset(&mask);
+    _sigaddset(&mask, SIGCHLD);
+    _sigprocmask(SIG_BLOCK, &mask, &prev);
+    for (job = jobs; job < jobs + MAXJOBS; job++)
+    {
+        if (!job->adopted)
+            continue;
+        if (job->pidfd >= 0)
+        {
+            pfd.fd = job->pidfd;
+            pfd.events = POLLIN;
+            gone = poll(&pfd, 1, 0) > 0;
+        }
+        else
+        {
+            gone = proc_starttime(job->pid, NULL) != job->start;
+        }
+        if (gone)
+        {
+            // The exit status of a process we did not fork is unknown
+            events[nevents % MAXEVENTS].pid = job->pid;
+            events[nevents % MAXEVENTS].jid = job->jid;
+            events[nevents % MAXEVENTS].status = 0;
+            nevents++;
+            deletejob(jobs, job->pid);
+        }
+    }
+    _sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * waitevent - Sleep with signal mask prev until a signal is handled or
+ *    an adopted job exits, letting the load governor run meanwhile.
+ *    Without adopted jobs or the governor this is sigsuspend.
+ */
+void waitevent(sigset_t *prev)
+{
+    struct pollfd fds[MAXJOBS];
+    struct timespec tick = {0, 100000000};
+    int i, n = 0, adopted = 0;
+
+    for (i = 0; i < MAXJOBS; i++)
+    {
+        if (!jobs[i].adopted)
+            continue;
+        adopted++;
+        if (jobs[i].pidfd >= 0)
+        {
+            fds[n].fd = jobs[i].pidfd;
+            fds[n].events = POLLIN;
+            n++;
+        }
+    }
+    if (adopted == 0 && !govon)
+    {
+        sigsuspend(prev);
+        return;
+    }
+
+    // Adopted jobs without a pidfd are checked every tick, the pressure every GOVTICK
+    if (n == adopted)
+    {
+        tick.tv_sec = GOVTICK / 1000000000;
+        tick.tv_nsec = GOVTICK % 1000000000;
+    }
+    ppoll(fds, n, n < adopted || govon ? &tick : NULL, prev);
+    reap_adopted();
+    govern_tick(0);
+}
+
+/*
+ * waitinput - Wait for the next command line while the load governor
+ *    is on, so it keeps looking at the pressure when the shell sits at
+ *    the prompt. Returns at once if readcmd already holds input.
+ */
+void waitinput(void)
+{
+    struct timespec tick = {GOVTICK / 1000000000, GOVTICK % 1000000000};
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = cmdin.fd;
+    pfd.events = POLLIN;
+    while (govon && cmdin.pos == cmdin.len)
+    {
+        if ((n = ppoll(&pfd, 1, &tick, NULL)) > 0 || (n < 0 && errno != EINTR))
+            return;
+        govern_tick(0);
+    }
+}
+
+/*
+ * readcmd - Read the next command line into line, like fgets but from
+ *    the shell's own buffer, so waitinput can tell whether a line is
+ *    already waiting. A last line without a newline gets one. Returns
+ *    the length read, 0 at end of file or -1 on a read error.
+ */
+int readcmd(char *line, int size)
+{
+    char *nl = NULL;
+    int n = 0, take;
+    ssize_t r;
+
+    while (n < size - 1 && nl == NULL)
+    {
+        if (cmdin.pos == cmdin.len)
+        {
+            if ((r = read(cmdin.fd, cmdin.buf, sizeof(cmdin.buf))) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (r == 0)
+                break;
+            cmdin.pos = 0;
+            cmdin.len = r;
+        }
+        take = cmdin.len - cmdin.pos < size - 1 - n ? cmdin.len - cmdin.pos : size - 1 - n;
+        if ((nl = memchr(cmdin.buf + cmdin.pos, '\n', take)) != NULL)
+            take = nl - (cmdin.buf + cmdin.pos) + 1;
+        memcpy(line + n, cmdin.buf + cmdin.pos, take);
+        cmdin.pos += take;
+        n += take;
+    }
+    if (n > 0 && nl == NULL && n < size - 1)
+        line[n++] = '\n';
+    line[n] = '\0';
+    return n;
+}
+/***********************************
+ * end job state file routines
+ ***********************************/
+
+/*******************************************
+ * Helper routines for the memo cache
+ *******************************************/
+
+/*
+ * "memo cmd args..." runs a deterministic command at most once. The
+ * key is a hash of the words of the command (with any VAR=value
+ * prefix), the working directory, the whole exported environment (in
+ * any order), and the inode, size and mtime of the program
+ * and of every argument naming a regular file. An entry is one file in
+ * $TSH_MEMO (default /tmp/tsh-memo-<uid>): a "TSHM1 status outlen
+ * errlen" line, then the captured stdout and stderr. A hit replays the
+ * entry without forking and marks it used by touching it; a miss runs
+ * the job with its output captured, shows the output when it finishes
+ * and stores it if the job exited. Entries are evicted oldest-used
+ * first to keep the cache under MEMOMAX bytes.
+ */
+
+/*
+ * do_memo - Execute the builtin memo command: -s prints the cache
+ *    statistics, -c empties the cache and -d cmd drops cmd's entry
+ */
+void do_memo(char **argv)
+{
+    char dir[MAXPATH], entry[MAXPATH + 32];
+    int n;
+
+    last_status = 0;
+    if (argv[1] != NULL && !strcmp(argv[1], "-s") && argv[2] == NULL)
+    {
+        if (memo_dir(dir) < 0)
+            return;
+        n = memo_evict(dir, MEMOMAX); // only counts, unless the cache is over its size
+        printf("memo: %d hits, %d misses, %d evictions, %d entries\n",
+               memohits, memomisses, memoevictions, n < 0 ? 0 : n);
+    }
+    else if (argv[1] != NULL && !strcmp(argv[1], "-c") && argv[2] == NULL)
+    {
+        if (memo_dir(dir) < 0)
+            return;
+        n = memo_evict(dir, 0);
+        memoevictions -= n < 0 ? 0 : n; // removed on request, not evicted
+    }
+    else if (argv[1] != NULL && !strcmp(argv[1], "-d") && argv[2] != NULL)
+    {
+        if (memo_key(argv + 2, entry) < 0)
+            return;
+        if (unlink(entry) < 0)
         {
-            // Child terminated normally. So, delete the job from the list.
-            if (verbose)
-                printf("   Child exited normally\n");
-            deletejob(jobs, pid);
+            printf("memo: no entry for %s\n", argv[2]);
+            last_status = 1;
         }
-        else if (WIFSIGNALED(status))
+    }
+    else
+    {
+        printf("usage: memo cmd [args] | memo -s | memo -c | memo -d cmd [args]\n");
+        last_status = 2;
+    }
+}
+
+/* memo_dir - Put the memo cache directory in dir, creating it if needed */
+int memo_dir(char *dir)
+{
+    char *d = env_get("TSH_MEMO");
+
+    if (d != NULL && *d != '\0')
+        snprintf(dir, MAXPATH, "%s", d);
+    else
+        snprintf(dir, MAXPATH, "/tmp/tsh-memo-%d", (int)getuid());
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    {
+        printf("memo: %s: %s\n", dir, strerror(errno));
+        last_status = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/* memo_hash - Continue the 64-bit FNV-1a hash h over len bytes of data */
+uint64_t memo_hash(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len-- > 0)
+    {
+        h ^= *p++;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/* memo_key - Put the path of the cache entry for argv in path */
+int memo_key(char **argv, char *path)
+{
+    char dir[MAXPATH], cwd[MAXLINE], **envp;
+    uint64_t h = 14695981039346656037ull, envsum = 0;
+    struct stat st;
+    long sig[4];
+    int i;
+
+    if (memo_dir(dir) < 0)
+        return -1;
+    for (i = 0; argv[i] != NULL; i++)
+        h = memo_hash(h, argv[i], strlen(argv[i]) + 1);
+    if (getcwd(cwd, MAXLINE) != NULL)
+        h = memo_hash(h, cwd, strlen(cwd) + 1);
+
+    // envp follows the hash table, so the variables are summed rather than chained
+    for (envp = env_envp(); *envp != NULL; envp++)
+        envsum += memo_hash(14695981039346656037ull, *envp, strlen(*envp) + 1);
+    h = memo_hash(h, &envsum, sizeof(envsum));
+
+    // Changing the program or an input file changes the key
+    for (argv = skipassign(argv); *argv != NULL; argv++)
+    {
+        if (stat(*argv, &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        sig[0] = (long)st.st_ino;
+        sig[1] = (long)st.st_size;
+        sig[2] = (long)st.st_mtim.tv_sec;
+        sig[3] = st.st_mtim.tv_nsec;
+        h = memo_hash(h, sig, sizeof(sig));
+    }
+
+    snprintf(path, MAXPATH + 32, "%s/%016llx", dir, (unsigned long long)h);
+    return 0;
+}
+
+/*
+ * memo_replay - Write the output of cache entry path and set the exit
+ *    status from it. Returns -1 if there is no usable entry.
+ */
+int memo_replay(char *path)
+{
+    char head[64];
+    long long outlen, errlen;
+    int fd, status, n, len;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, head, sizeof(head) - 1);
+    head[n < 0 ? 0 : n] = '\0';
+    if (sscanf(head, MEMOMAGIC " %d %lld %lld\n%n", &status, &outlen, &errlen, &len) != 3)
+    {
+        close(fd);
+        return -1;
+    }
+
+    fflush(stdout);
+    lseek(fd, len, SEEK_SET);
+    if (memo_copy(fd, STDOUT_FILENO, outlen) < 0 || memo_copy(fd, STDERR_FILENO, errlen) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    futimens(fd, NULL); // Touched entries are the most recently used
+    close(fd);
+    memohits++;
+    last_status = status;
+    return 0;
+}
+
+/* memo_begin - Open the unnamed files that the next job's output is captured in */
+int memo_begin(void)
+{
+    char dir[MAXPATH];
+    int i;
+
+    memomisses++;
+    if (memo_dir(dir) < 0)
+        return -1;
+    for (i = 0; i < 2; i++)
+    {
+        if ((memofd[i] = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0)
         {
-            // Child terminated because of an uncaught signal. So, delete the job from the list.
-            // Also, according to reference solution, we must print the signal which caused the termination. (use WTERMSIG)
-            int terminator = WTERMSIG(status);
-            printf("JOB [%d] (%d) terminated by SIGNAL %d\n", pid2jid(pid), pid, terminator);
-            deletejob(jobs, pid);
+            printf("memo: %s: %s\n", dir, strerror(errno));
+            if (i == 1)
+                close(memofd[0]);
+            memofd[0] = memofd[1] = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * memo_end - Show the output captured by memo_begin and, if store is
+ *    set, save it with the job's exit status as cache entry path. If
+ *    the job was stopped instead, it keeps writing to the capture files,
+ *    so they are handed to reap_memos to show the rest of its output.
+ */
+void memo_end(char *path, int store)
+{
+    char tmp[MAXPATH + 64], dir[MAXPATH], head[64];
+    struct jobevent_t *ev;
+    struct memocap_t *mc;
+    off_t len[2];
+    int fd, i, n;
+
+    if (memofd[0] < 0)
+        return;
+    fflush(stdout);
+    for (i = 0; i < 2; i++)
+    {
+        len[i] = lseek(memofd[i], 0, SEEK_END);
+        lseek(memofd[i], 0, SEEK_SET);
+        memo_copy(memofd[i], i == 0 ? STDOUT_FILENO : STDERR_FILENO, len[i]);
+    }
+
+    // A stopped job is not cached, but what it prints after fg or bg must still show
+    ev = &events[(nevents + MAXEVENTS - 1) % MAXEVENTS];
+    if (!store && nevents > 0 && WIFSTOPPED(ev->status) && getjobpid(jobs, ev->pid) != NULL)
+    {
+        for (mc = memocaps; mc < memocaps + MAXJOBS && mc->pid != 0; mc++)
+            ;
+        if (mc < memocaps + MAXJOBS)
+        {
+            mc->pid = ev->pid;
+            for (i = 0; i < 2; i++)
+            {
+                mc->fd[i] = memofd[i];
+                mc->shown[i] = len[i];
+            }
+            memofd[0] = memofd[1] = -1;
+            return;
+        }
+    }
+
+    if (store && len[0] + len[1] <= MEMOMAX / 4)
+    {
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+        if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) >= 0)
+        {
+            n = snprintf(head, sizeof(head), MEMOMAGIC " %d %lld %lld\n",
+                         last_status, (long long)len[0], (long long)len[1]);
+            store = write(fd, head, n) == n;
+            for (i = 0; i < 2 && store; i++)
+            {
+                lseek(memofd[i], 0, SEEK_SET);
+                store = memo_copy(memofd[i], fd, len[i]) == 0;
+            }
+            close(fd);
+            if (!store || rename(tmp, path) < 0)
+                unlink(tmp);
+            else if (memo_dir(dir) == 0)
+                memo_evict(dir, MEMOMAX);
+        }
+    }
+
+    close(memofd[0]);
+    close(memofd[1]);
+    memofd[0] = memofd[1] = -1;
+}
+
+/*
+ * reap_memos - Show what stopped memo jobs have written since the last
+ *    call, and close their capture files once the job has gone. Runs
+ *    from the main loop, so a resumed job's output appears when it
+ *    finishes in the foreground or at the next prompt in the background.
+ */
+void reap_memos(void)
+{
+    struct memocap_t *mc;
+    sigset_t mask, prev;
+    off_t len;
+    int i, gone;
+
+    _sigemptyset(&mask);
+    _sigaddset(&mask, SIGCHLD);
+    _sigprocmask(SIG_BLOCK, &mask, &prev);
+    for (mc = memocaps; mc < memocaps + MAXJOBS; mc++)
+    {
+        if (mc->pid == 0)
+            continue;
+        gone = getjobpid(jobs, mc->pid) == NULL;
+        fflush(stdout);
+        for (i = 0; i < 2; i++)
+        {
+            len = lseek(mc->fd[i], 0, SEEK_END);
+            if (len > mc->shown[i])
+            {
+                lseek(mc->fd[i], mc->shown[i], SEEK_SET);
+                memo_copy(mc->fd[i], i == 0 ? STDOUT_FILENO : STDERR_FILENO, len - mc->shown[i]);
+                mc->shown[i] = len;
+            }
+            if (gone)
+                close(mc->fd[i]);
+        }
+        if (gone)
+            mc->pid = 0;
+    }
+    _sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* memo_copy - Copy len bytes from fd from to fd to */
+int memo_copy(int from, int to, off_t len)
+{
+    char buf[8192];
+    ssize_t n, w;
+
+    while (len > 0)
+    {
+        if ((n = read(from, buf, len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf))) <= 0)
+            return -1;
+        len -= n;
+        for (w = 0; w < n;)
+        {
+            ssize_t k = write(to, buf + w, n - w);
+            if (k < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            w += k;
+        }
+    }
+    return 0;
+}
+
+/* memoent_t - One cache entry, for sorting by last use */
+struct memoent_t
+{
+    char name[20];
+    time_t used;
+    off_t size;
+};
+
+/* memo_older - qsort comparison putting the least recently used entry first */
+static int memo_older(const void *a, const void *b)
+{
+    const struct memoent_t *x = a, *y = b;
+
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+/*
+ * memo_evict - Remove the least recently used entries of dir until
+ *    they take at most max bytes. Returns the number of entries left,
+ *    or of entries removed if max is 0.
+ */
+int memo_evict(char *dir, off_t max)
+{
+    struct memoent_t *ents = NULL, *grown;
+    char path[MAXPATH + 32];
+    struct dirent *de;
+    struct stat st;
+    off_t total = 0;
+    int n = 0, cap = 0, i;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+        return -1;
+    while ((de = readdir(dp)) != NULL)
+    {
+        // Only finished entries: 16 hex digits, no temporary suffix
+        if (strlen(de->d_name) != 16 || strspn(de->d_name, "0123456789abcdef") != 16)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) < 0)
+            continue;
+        if (n == cap)
+        {
+            cap = cap ? 2 * cap : 64;
+            if ((grown = realloc(ents, cap * sizeof(*ents))) == NULL)
+                break;
+            ents = grown;
+        }
+        strcpy(ents[n].name, de->d_name);
+        ents[n].used = st.st_mtime;
+        ents[n].size = st.st_size;
+        total += st.st_size;
+        n++;
+    }
+    closedir(dp);
+
+    qsort(ents, n, sizeof(*ents), memo_older);
+    for (i = 0; i < n && (total > max || max == 0); i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, ents[i].name);
+        if (unlink(path) == 0)
+        {
+            total -= ents[i].size;
+            memoevictions++;
+        }
+    }
+    free(ents);
+    return max == 0 ? i : n - i;
+}
+/***********************************
+ * end memo cache routines
+ ***********************************/
+
+/*******************************************
+ * Helper routines for the load governor
+ *******************************************/
+
+/*
+ * When enabled with "govern on", the governor looks at the system
+ * pressure at most once per GOVTICK: before each prompt and while the
+ * shell waits for a job or for input. The pressure is the highest
+ * "some avg10" of /proc/pressure/{cpu,memory,io} ($TSH_PSI names
+ * another directory to read them from), or the 1 minute load average
+ * per CPU where PSI is unavailable. Above the high mark it pauses the
+ * youngest running background job with SIGSTOP; below the low mark it
+ * resumes the last job it paused with SIGCONT. One job moves per look,
+ * so the pressure has time to react. Paused jobs are in the ST state and are
+ * listed as "Stopped (governor)"; fg and bg take them back as usual.
+ */
+
+/*
+ * do_govern - Execute the builtin govern command:
+ *    govern                  show the governor state and the pressure
+ *    govern on [high [low]]  enable it, with marks in percent
+ *    govern off              disable it and resume the jobs it paused
+ */
+void do_govern(char **argv)
+{
+    const char *source;
+    double high = govhigh, low = govlow, p;
+    int i, n;
+
+    last_status = 0;
+    if (argv[1] == NULL)
+    {
+        for (i = 0, n = 0; i < MAXJOBS; i++)
+            n += jobs[i].governed != 0;
+        p = pressure(&source);
+        printf("govern: %s, high %g%%, low %g%%, ", govon ? "on" : "off", govhigh, govlow);
+        if (p < 0)
+            printf("pressure unknown");
+        else
+            printf("pressure %.1f%% (%s)", p, source);
+        printf(", %d paused\n", n);
+    }
+    else if (!strcmp(argv[1], "on") && (argv[2] == NULL || argv[3] == NULL || argv[4] == NULL))
+    {
+        if (argv[2] != NULL)
+        {
+            high = atof(argv[2]);
+            low = argv[3] != NULL ? atof(argv[3]) : high / 2;
+        }
+        if (high <= 0 || low < 0 || low >= high)
+        {
+            printf("govern: need 0 <= low < high\n");
+            last_status = 1;
+            return;
+        }
+        govhigh = high;
+        govlow = low;
+        govon = 1;
+        govern_tick(1);
+    }
+    else if (!strcmp(argv[1], "off") && argv[2] == NULL)
+    {
+        govon = 0;
+        for (i = 0; i < MAXJOBS; i++)
+        {
+            if (jobs[i].governed)
+            {
+                kill(-jobs[i].pid, SIGCONT);
+                setjobstate(&jobs[i], BG);
+            }
+        }
+    }
+    else
+    {
+        printf("usage: govern [on [high [low]] | off]\n");
+        last_status = 2;
+    }
+}
+
+/*
+ * govern_tick - Pause or resume one background job if the pressure
+ *    calls for it. Does nothing if the last look was less than GOVTICK
+ *    ago, unless force is set.
+ */
+void govern_tick(int force)
+{
+    struct job_t *job, *pick = NULL;
+    const char *source;
+    sigset_t mask, prev;
+    double p;
+
+    if (!govon || subshell || (!force && elapsed(&govlast) < GOVTICK))
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &govlast);
+    if ((p = pressure(&source)) < 0)
+        return;
+
+    _sigemptyset(&mask);
+    _sigaddset(&mask, SIGCHLD);
+    _sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (p > govhigh)
+    {
+        // The youngest running job has the least work to lose by waiting
+        for (job = jobs; job < jobs + MAXJOBS; job++)
+            if (job->state == BG && (pick == NULL || job->jid > pick->jid))
+                pick = job;
+        if (pick != NULL)
+        {
+            pick->governed = ++govpauses; // Set first, so the reaper keeps quiet about the stop
+            kill(-pick->pid, SIGSTOP);
+            setjobstate(pick, ST);
+        }
+    }
+    else if (p < govlow)
+    {
+        // The job paused last is resumed first
+        for (job = jobs; job < jobs + MAXJOBS; job++)
+            if (job->governed && (pick == NULL || job->governed > pick->governed))
+                pick = job;
+        if (pick != NULL)
+        {
+            kill(-pick->pid, SIGCONT);
+            setjobstate(pick, BG);
+        }
+    }
+    _sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * pressure - Return the system pressure in percent, or -1 if it cannot
+ *    be read, and set *source to where it came from
+ */
+double pressure(const char **source)
+{
+    static const char *psi[] = {"cpu", "memory", "io", NULL};
+    char buf[MAXLINE], path[MAXPATH + 16];
+    char *dir = env_get("TSH_PSI");
+    double avg, max = -1;
+    long ncpu;
+    FILE *fp;
+    int i;
+
+    for (i = 0; psi[i] != NULL; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir != NULL && *dir != '\0' ? dir : "/proc/pressure", psi[i]);
+        if ((fp = fopen(path, "r")) == NULL)
+            continue;
+        if (fgets(buf, MAXLINE, fp) != NULL && sscanf(buf, "some avg10=%lf", &avg) == 1 && avg > max)
+            max = avg;
+        fclose(fp);
+    }
+    if (max >= 0)
+    {
+        *source = "psi";
+        return max;
+    }
+
+    // Without PSI, one runnable task per CPU counts as 100%
+    *source = "loadavg";
+    if ((fp = fopen("/proc/loadavg", "r")) == NULL)
+        return -1;
+    if (fscanf(fp, "%lf", &avg) != 1)
+        avg = -1;
+    fclose(fp);
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        ncpu = 1;
+    return avg < 0 ? -1 : 100 * avg / ncpu;
+}
+/***********************************
+ * end load governor routines
+ ***********************************/
+
+/*******************************************
+ * Helper routines for sourced scripts
+ *******************************************/
+
+/*
+ * "source file" runs the lines of file in the current shell, as if
+ * they had been typed at the prompt. The whole file is parsed with
+ * parselist before anything runs, and the result is kept in the script
+ * cache (keyed by path, inode, size and mtime) so that running the file
+ * again skips the parsing. The parsed form of a file is a run of
+ * records, one per non-blank line:
+ *
+ *    line number (an int), ncmds, bg
+ *    for each command: op, argc, its argc words, its text
+ *    the text of the whole line
+ *
+ * where ncmds, bg, op and argc are single bytes and every word and text
+ * is a NUL-terminated string. source_next points a cmdlist_t at one
+ * record without copying it. Errors are reported as "file:line: ...",
+ * and ctrl-c stops the script after the current line.
+ */
+
+/* do_source - Execute the builtin source command */
+void do_source(char **argv)
+{
+    struct script_t *sc;
+    struct cmdlist_t list;
+    char where[sizeof(srcwhere)], *p, *cmdline;
+    int line, ints = nints;
+
+    if (argv[1] == NULL || argv[2] != NULL)
+    {
+        printf("usage: source file\n");
+        last_status = 2;
+        return;
+    }
+    if (srcdepth == MAXDEPTH)
+    {
+        printf("%ssource: %s: nested too deeply\n", srcwhere, argv[1]);
+        last_status = 2;
+        return;
+    }
+    if ((sc = getscript(argv[1])) == NULL)
+    {
+        return;
+    }
+
+    // The script stays in the cache while it runs, even if a nested source changes it
+    strcpy(where, srcwhere);
+    sc->busy++;
+    srcdepth++;
+    last_status = 0;
+    for (p = sc->code; p < sc->code + sc->len && nints == ints;)
+    {
+        p = source_next(p, &list, &line, &cmdline);
+        snprintf(srcwhere, sizeof(srcwhere), "%s:%d: ", sc->path, line);
+        eval_list(&list, cmdline, 0);
+    }
+    if (nints != ints)
+    {
+        last_status = 130;
+        int_pending = 0;
+    }
+    srcdepth--;
+    sc->busy--;
+    strcpy(srcwhere, where);
+}
+
+/*
+ * getscript - Return the script cache entry for path, parsing the file
+ *    if it is not cached or has changed. Returns NULL after printing a
+ *    message if the file cannot be read or parsed.
+ */
+struct script_t *getscript(char *path)
+{
+    struct script_t *sc, *slot = NULL;
+    struct stat st;
+    FILE *fp;
+    int rc;
+
+    if (stat(path, &st) < 0 || (fp = fopen(path, "r")) == NULL)
+    {
+        printf("%ssource: %s: %s\n", srcwhere, path, strerror(errno));
+        last_status = 1;
+        return NULL;
+    }
+
+    for (sc = scripts; sc < scripts + MAXSCRIPTS; sc++)
+    {
+        if (sc->path[0] != '\0' && !strcmp(sc->path, path) && sc->dev == st.st_dev &&
+            sc->ino == st.st_ino && sc->size == st.st_size &&
+            sc->mtime.tv_sec == st.st_mtim.tv_sec && sc->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            fclose(fp);
+            sc->used = ++srcuses;
+            return sc;
+        }
+
+        // A miss replaces a free slot, or the least recently run script not running now
+        if (!sc->busy && (slot == NULL || sc->used < slot->used))
+        {
+            slot = sc;
+        }
+    }
+    if (slot == NULL || strlen(path) >= MAXPATH)
+    {
+        printf("%ssource: %s: cannot cache the script\n", srcwhere, path);
+        fclose(fp);
+        last_status = 1;
+        return NULL;
+    }
+
+    free(slot->code);
+    slot->code = NULL;
+    slot->len = 0;
+    slot->used = 0;
+    strcpy(slot->path, path);
+    rc = source_parse(slot, fp);
+    fclose(fp);
+    if (rc < 0)
+    {
+        free(slot->code);
+        slot->code = NULL;
+        slot->path[0] = '\0';
+        last_status = 2;
+        return NULL;
+    }
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->size = st.st_size;
+    slot->mtime = st.st_mtim;
+    slot->used = ++srcuses;
+    return slot;
+}
+
+/*
+ * source_parse - Parse every line of fp into sc->code. Returns -1
+ *    after printing a message with the file and line of the first
+ *    malformed line.
+ */
+int source_parse(struct script_t *sc, FILE *fp)
+{
+    struct cmdlist_t list;
+    char buf[MAXLINE + 1], where[sizeof(srcwhere)], *p, *grown, **w;
+    size_t cap = 0, len;
+    int line = 0, i, rc = 0;
+
+    strcpy(where, srcwhere);
+    while (rc == 0 && fgets(buf, MAXLINE, fp) != NULL)
+    {
+        line++;
+        snprintf(srcwhere, sizeof(srcwhere), "%s:%d: ", sc->path, line);
+        len = strlen(buf);
+        if (buf[len - 1] != '\n')
+        {
+            if (!feof(fp))
+            {
+                printf("%sline too long\n", srcwhere);
+                rc = -1;
+                break;
+            }
+            strcpy(buf + len++, "\n"); // Job lists expect newline-terminated commands
+        }
+        if (parselist(buf, &list) < 0)
+        {
+            rc = -1;
+            break;
+        }
+        if (list.ncmds == 0)
+        {
+            continue;
         }
 
-        else if (WIFSTOPPED(status))
+        // A record is never longer than the line plus the parser's own storage
+        if (sc->len + sizeof(int) + 2 + 2 * MAXCMDS + sizeof(list.args) + sizeof(list.text) + len + 1 > cap)
         {
-            // Child is currently stopped. No need to delete.
-            job->state = ST; // Set the state to ST (stopped)
-            // According to reference solution, we should print the Signal that caused the stop. (use WSTOPSIG)
-            int stopper = WSTOPSIG(status);
-            printf("JOB [%d] (%d) stopped by SIGNAL %d\n", pid2jid(pid), pid, stopper);
+            cap = cap ? 2 * cap : 16384;
+            if ((grown = realloc(sc->code, cap)) == NULL)
+                unix_error("realloc error");
+            sc->code = grown;
+        }
+        p = sc->code + sc->len;
+        memcpy(p, &line, sizeof(int));
+        p += sizeof(int);
+        *p++ = list.ncmds;
+        *p++ = list.bg;
+        for (i = 0; i < list.ncmds; i++)
+        {
+            *p++ = list.cmds[i].op;
+            for (w = list.cmds[i].argv; *w != NULL; w++)
+                ;
+            *p++ = w - list.cmds[i].argv;
+            for (w = list.cmds[i].argv; *w != NULL; w++)
+                p = stpcpy(p, *w) + 1;
+            p = stpcpy(p, list.cmds[i].cmdline) + 1;
         }
+        p = stpcpy(p, buf) + 1;
+        sc->len = p - sc->code;
     }
-
-    // Detect Error and print accordingly (got this part from the textbook)
-    // if (errno == ECHILD)
-    // {
-    //     unix_error("Error in WaitPID\n");
-    // }
-
-    return;
+    strcpy(srcwhere, where);
+    return rc;
 }
 
 /*
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.
+ * source_next - Point list at the commands of the record at code, set
+ *    line and cmdline to its line number and text, and return the
+ *    start of the next record
  */
-void sigint_handler(int sig)
+char *source_next(char *code, struct cmdlist_t *list, int *line, char **cmdline)
 {
-    // printf("Interrupt Signal\n");
+    char **argv = list->argv;
+    int i, argc;
 
-    // Get the process ID and send the SIGINT signal using kill function
-    pid_t pid = fgpid(jobs);
-    if (pid != 0)
+    memcpy(line, code, sizeof(int));
+    code += sizeof(int);
+    list->ncmds = (unsigned char)*code++;
+    list->bg = *code++;
+    for (i = 0; i < list->ncmds; i++)
     {
-        if (verbose)
+        list->cmds[i].op = *code++;
+        argc = (unsigned char)*code++;
+        list->cmds[i].argv = argv;
+        while (argc-- > 0)
         {
-            printf("Terminating the foreground job\n");
+            *argv++ = code;
+            code += strlen(code) + 1;
         }
-
-        kill(-pid, SIGINT);
+        *argv++ = NULL;
+        list->cmds[i].cmdline = code;
+        code += strlen(code) + 1;
     }
-
-    return;
+    *cmdline = code;
+    return code + strlen(code) + 1;
 }
+/***********************************
+ * end sourced script routines
+ ***********************************/
+
+/*******************************************
+ * Helper routines for the command history
+ *******************************************/
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.
+ * A shell reading commands from a terminal appends every command line
+ * to $TSH_HISTORY (default ~/.tsh_history; set it empty to turn history
+ * off), and the start offset of each line, as a uint64_t, to the same
+ * path plus ".idx". Without a terminal, or with -p, only an explicit
+ * $TSH_HISTORY turns history on, so driven shells leave ~/.tsh_history
+ * alone. At startup both files are mapped rather than read, so !n is
+ * a lookup in the offset array whatever the size of the history. The
+ * index is only rebuilt by scanning the history if it does not match,
+ * e.g. after a crash or when the history was edited by hand. Lines
+ * added during the session are kept in histnew.
+ *
+ * !prefix searches the session's lines newest first, then the mapped
+ * lines through histtree. Its leaves are the entry numbers of the
+ * first histtreen mapped lines sorted by text, so the entries with a
+ * given prefix are a contiguous run found by binary search, and each
+ * inner node holds the newest entry below it, so the newest entry of
+ * the run takes O(log n) more steps. The whole tree is kept in the
+ * path plus ".tree", headed by how many entries it covers, how many
+ * bytes of history they take and where the last one starts, and is
+ * mapped as it is when that header still matches. Mapped lines newer
+ * than the tree are scanned; once there are more than HISTTAIL of them
+ * the tree is rebuilt by sorting just those and merging them in.
  */
-void sigtstp_handler(int sig)
+
+/* hist_open - Map the history and its index, creating them if needed */
+void hist_open(void)
 {
-    // printf(" Suspend signal\n");
+    char path[MAXPATH], idx[MAXPATH + 8], *name, *home;
+    struct stat st;
+    char last;
 
-    // Get the process ID and send the signal using kill function
-    pid_t pid = fgpid(jobs);
-    if (pid != 0)
+    if ((name = env_get("TSH_HISTORY")) != NULL)
     {
-        if (verbose)
-        {
-            printf("Suspending the forground job\n");
-        }
+        if (*name == '\0')
+            return; // History turned off
+        snprintf(path, MAXPATH, "%s", name);
+    }
+    else if ((home = env_get("HOME")) != NULL)
+        snprintf(path, MAXPATH, "%s/.tsh_history", home);
+    else
+        return;
+    snprintf(idx, sizeof(idx), "%s.idx", path);
+    snprintf(histtreepath, sizeof(histtreepath), "%s.tree", path);
 
-        kill(-pid, SIGTSTP);
+    if ((histfd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0 ||
+        (histidxfd = open(idx, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0)
+    {
+        printf("history: %s: %s\n", histfd < 0 ? path : idx, strerror(errno));
+        if (histfd >= 0)
+            close(histfd);
+        histfd = -1;
+        return;
     }
 
-    return;
+    // A line cut short by a crash is finished, so every entry ends in a newline
+    if (fstat(histfd, &st) == 0 && st.st_size > 0 &&
+        pread(histfd, &last, 1, st.st_size - 1) == 1 && last != '\n')
+    {
+        if (write(histfd, "\n", 1) == 1)
+            st.st_size++;
+    }
+    if (st.st_size > 0)
+    {
+        histmap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, histfd, 0);
+        if (histmap == MAP_FAILED)
+            unix_error("mmap error");
+        histsize = st.st_size;
+    }
+    hist_mapindex(0);
 }
 
-/*********************
- * End signal handlers
- *********************/
+/*
+ * hist_mapindex - Map the offset file, first rebuilding it from the
+ *    history if rebuild is set or its last offset is not where the
+ *    last history line starts
+ */
+void hist_mapindex(int rebuild)
+{
+    struct stat st;
+    uint64_t last, buf[1024];
+    char *p, *next, *end;
+    int n = 0;
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+    if (histoff != NULL)
+        munmap(histoff, nhist * sizeof(uint64_t));
+    histoff = NULL;
+    nhist = 0;
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job)
-{
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    if (fstat(histidxfd, &st) < 0)
+        unix_error("fstat error");
+    if (!rebuild && st.st_size % sizeof(uint64_t) == 0)
+    {
+        if (st.st_size == 0)
+            rebuild = histsize != 0;
+        else if (pread(histidxfd, &last, sizeof(last), st.st_size - sizeof(last)) != sizeof(last) ||
+                 last >= histsize || (last > 0 && histmap[last - 1] != '\n') ||
+                 memchr(histmap + last, '\n', histsize - last) != histmap + histsize - 1)
+            rebuild = 1;
+    }
+    else
+        rebuild = 1;
+
+    if (rebuild)
+    {
+        if (ftruncate(histidxfd, 0) < 0)
+            unix_error("ftruncate error");
+        for (p = histmap, end = histmap + histsize; p < end; p = next)
+        {
+            next = (char *)memchr(p, '\n', end - p) + 1;
+            buf[n++] = p - histmap;
+            if (n == 1024 || next == end)
+            {
+                if (write(histidxfd, buf, n * sizeof(uint64_t)) < 0)
+                    unix_error("write error");
+                n = 0;
+            }
+        }
+        if (fstat(histidxfd, &st) < 0)
+            unix_error("fstat error");
+    }
+
+    if (st.st_size > 0)
+    {
+        histoff = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, histidxfd, 0);
+        if (histoff == MAP_FAILED)
+            unix_error("mmap error");
+        nhist = st.st_size / sizeof(uint64_t);
+    }
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs)
+/* hist_line - Return history entry n (from 1) and its length, or NULL */
+char *hist_line(int n, int *len)
 {
-    int i;
+    char *p;
 
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&jobs[i]);
+    if (n >= 1 && n <= nhist && histoff[n - 1] < histsize)
+    {
+        p = histmap + histoff[n - 1];
+        *len = (char *)memchr(p, '\n', histmap + histsize - p) - p;
+        return p;
+    }
+    if (n > nhist && n <= nhist + nnew)
+    {
+        *len = strlen(histnew[n - nhist - 1]);
+        return histnew[n - nhist - 1];
+    }
+    return NULL;
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs)
+/* hist_add - Append cmdline to the history, unless it is blank */
+void hist_add(char *cmdline)
 {
-    int i, max = 0;
+    char buf[MAXLINE + 1], **grown;
+    uint64_t off;
+    int len = strcspn(cmdline, "\n");
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid > max)
-            max = jobs[i].jid;
-    return max;
+    if (cmdline[strspn(cmdline, " \t\n")] == '\0')
+        return;
+
+    // One write each, so shells sharing the history do not interleave lines
+    memcpy(buf, cmdline, len);
+    buf[len] = '\n';
+    if (write(histfd, buf, len + 1) != len + 1)
+        return;
+    off = lseek(histfd, 0, SEEK_CUR) - (len + 1);
+    if (write(histidxfd, &off, sizeof(off)) < 0)
+        return;
+
+    if (nnew == capnew)
+    {
+        capnew = capnew ? 2 * capnew : 64;
+        if ((grown = realloc(histnew, capnew * sizeof(char *))) == NULL)
+            unix_error("realloc error");
+        histnew = grown;
+    }
+    if ((histnew[nnew] = strndup(cmdline, len)) == NULL)
+        unix_error("strndup error");
+    nnew++;
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
+/*
+ * hist_expand - Replace !!, !n, !-n and !prefix at the start of a word
+ *    of cmdline (outside quotes) with the history line they name, and
+ *    echo the result if anything changed. Returns -1 after printing a
+ *    message if an event is not found.
+ */
+int hist_expand(char *cmdline)
 {
-    int i;
-
-    if (pid < 1)
-        return 0;
+    char out[MAXLINE], *p = cmdline, *start, *line;
+    int o = 0, quoted = 0, changed = 0, total = nhist + nnew, n, len;
 
-    for (i = 0; i < MAXJOBS; i++)
+    while (*p != '\0')
     {
-        if (jobs[i].pid == 0)
+        if (*p == '\'')
+            quoted = !quoted;
+        if (*p != '!' || quoted || (p > cmdline && !strchr(" \t;&|", p[-1])) ||
+            p[1] == '\0' || strchr(" \t\n=;&|", p[1]))
         {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = nextjid++;
-            if (nextjid > MAXJOBS)
-                nextjid = 1;
-            strcpy(jobs[i].cmdline, cmdline);
-            if (verbose)
-            {
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
+            if (o == MAXLINE - 1)
+                break;
+            out[o++] = *p++;
+            continue;
+        }
+
+        start = p++;
+        if (*p == '!')
+        {
+            n = total;
+            p++;
+        }
+        else if (*p == '-' && isdigit(p[1]))
+            n = total + 1 - strtol(p + 1, &p, 10);
+        else if (isdigit(*p))
+            n = strtol(p, &p, 10);
+        else
+        {
+            len = strcspn(p, " \t\n;&|");
+            n = hist_find(p, len);
+            p += len;
+        }
+        if ((line = hist_line(n, &len)) == NULL)
+        {
+            printf("%.*s: event not found\n", (int)(p - start), start);
+            last_status = 1;
+            return -1;
         }
+        if (o + len >= MAXLINE - 1)
+        {
+            printf("%.*s: expanded line too long\n", (int)(p - start), start);
+            last_status = 1;
+            return -1;
+        }
+        memcpy(out + o, line, len);
+        o += len;
+        changed = 1;
+    }
+    out[o] = '\0';
+
+    if (changed)
+    {
+        strcpy(cmdline, out);
+        printf("%s", cmdline);
+        fflush(stdout);
     }
-    printf("Tried to create too many jobs\n");
     return 0;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid)
+/* hist_find - Return the newest history entry starting with prefix, or 0 */
+int hist_find(const char *prefix, int len)
 {
-    int i;
+    int i, lo, hi, mid, newest = 0;
 
-    if (pid < 1)
+    for (i = nnew; i > 0; i--)
+        if (!strncmp(histnew[i - 1], prefix, len))
+            return nhist + i;
+    if (nhist == 0)
         return 0;
+    if (histtree == NULL)
+        hist_index();
 
-    for (i = 0; i < MAXJOBS; i++)
+    // Mapped lines the tree does not cover yet are newer than all it holds
+    for (i = nhist; i > histtreen; i--)
+        if (histoff[i - 1] < histsize && hist_prefcmp(i, prefix, len) == 0)
+            return i;
+
+    // The run of leaves with the prefix: [lo, hi)
+    for (lo = 0, hi = histtreen; lo < hi;)
     {
-        if (jobs[i].pid == pid)
-        {
-            clearjob(&jobs[i]);
-            nextjid = maxjid(jobs) + 1;
-            return 1;
-        }
+        mid = (lo + hi) / 2;
+        if (hist_prefcmp(histtree[histtreen + mid], prefix, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    return 0;
+    for (hi = histtreen, i = lo; i < hi;)
+    {
+        mid = (i + hi) / 2;
+        if (hist_prefcmp(histtree[histtreen + mid], prefix, len) <= 0)
+            i = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // The newest entry of the run, from the nodes that cover it
+    for (lo += histtreen, hi += histtreen; lo < hi; lo /= 2, hi /= 2)
+    {
+        if (lo & 1)
+            newest = histtree[lo] > newest ? histtree[lo] : newest, lo++;
+        if (hi & 1)
+            hi--, newest = histtree[hi] > newest ? histtree[hi] : newest;
+    }
+    return newest;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs)
+/*
+ * hist_index - Set up histtree: map the saved tree if it is close
+ *    enough to current, otherwise extend it to all mapped entries
+ */
+void hist_index(void)
 {
-    int i;
+    int i, j, k, n, *tree, *leaves, *run;
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].state == FG)
-            return jobs[i].pid;
-    return 0;
+    if (hist_maptree() && nhist - histtreen <= HISTTAIL)
+        return;
+    n = histtreen;
+
+    // Sorting follows the offsets, so they must all be line starts
+    for (i = 0; i < nhist; i++)
+        if (histoff[i] >= histsize || (histoff[i] > 0 && histmap[histoff[i] - 1] != '\n'))
+            break;
+    if (i < nhist)
+    {
+        hist_mapindex(1);
+        n = 0; // The saved tree followed the old offsets
+    }
+
+    if ((tree = malloc(2 * (nhist + 1) * sizeof(int))) == NULL)
+        unix_error("malloc error");
+    leaves = tree + nhist;
+    if (n > 0)
+        memcpy(leaves, histtree + n, n * sizeof(int));
+
+    // Only the entries the saved tree does not cover need sorting
+    if ((run = malloc((nhist - n) * sizeof(int))) == NULL)
+        unix_error("malloc error");
+    for (i = n; i < nhist; i++)
+        run[i - n] = i + 1;
+    qsort(run, nhist - n, sizeof(int), hist_cmp);
+
+    // Merge from the back, so the saved run can stay where it is
+    for (i = n - 1, j = nhist - n - 1, k = nhist - 1; j >= 0; k--)
+        leaves[k] = i >= 0 && hist_cmp(&leaves[i], &run[j]) > 0 ? leaves[i--] : run[j--];
+    free(run);
+    for (i = nhist - 1; i > 0; i--)
+        tree[i] = tree[2 * i] > tree[2 * i + 1] ? tree[2 * i] : tree[2 * i + 1];
+
+    if (histtreemap != NULL)
+        munmap(histtreemap, histtreesize);
+    histtreemap = NULL;
+    histtree = tree;
+    histtreen = nhist;
+    hist_savetree();
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid)
+/*
+ * hist_maptree - Map the saved tree if its header matches the mapped
+ *    history. Returns true and sets histtree and histtreen if it does.
+ */
+int hist_maptree(void)
 {
-    int i;
+    uint64_t head[3]; // entries covered, bytes they take, offset of the last
+    struct stat st;
+    void *map;
+    int fd;
 
-    if (pid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid)
-            return &jobs[i];
-    return NULL;
+    if ((fd = open(histtreepath, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || pread(fd, head, sizeof(head), 0) != sizeof(head) ||
+        head[0] == 0 || head[0] > (uint64_t)nhist ||
+        (uint64_t)st.st_size != sizeof(head) + 2 * head[0] * sizeof(int) ||
+        head[1] != (head[0] < (uint64_t)nhist ? histoff[head[0]] : histsize) ||
+        head[2] != histoff[head[0] - 1])
+    {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    histtreemap = map;
+    histtreesize = st.st_size;
+    histtree = (int *)((char *)map + sizeof(head));
+    histtreen = head[0];
+    return 1;
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid)
+/* hist_savetree - Save histtree, which covers all nhist mapped entries */
+void hist_savetree(void)
 {
-    int i;
+    uint64_t head[3] = {nhist, histsize, histoff[nhist - 1]};
+    char tmp[sizeof(histtreepath) + 16];
+    ssize_t size = 2 * nhist * sizeof(int);
+    int fd, ok;
 
-    if (jid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid == jid)
-            return &jobs[i];
-    return NULL;
+    // Written aside and renamed, so a concurrent session never maps half of it
+    snprintf(tmp, sizeof(tmp), "%s.%d", histtreepath, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return;
+    ok = write(fd, head, sizeof(head)) == sizeof(head) && write(fd, histtree, size) == size;
+    close(fd);
+    if (!ok || rename(tmp, histtreepath) < 0)
+        unlink(tmp);
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid)
+/* hist_cmp - qsort comparison of two mapped entries by text, then age */
+int hist_cmp(const void *a, const void *b)
+{
+    const unsigned char *p = (unsigned char *)histmap + histoff[*(int *)a - 1];
+    const unsigned char *q = (unsigned char *)histmap + histoff[*(int *)b - 1];
+
+    while (*p == *q && *p != '\n')
+        p++, q++;
+    if (*p == *q)
+        return *(int *)a - *(int *)b;
+    if (*p == '\n' || *q == '\n')
+        return *p == '\n' ? -1 : 1; // The end of a line sorts first
+    return *p - *q;
+}
+
+/*
+ * hist_prefcmp - Compare mapped entry n with prefix in the order of
+ *    hist_cmp: 0 if the entry starts with prefix
+ */
+int hist_prefcmp(int n, const char *prefix, int len)
 {
+    const unsigned char *p = (unsigned char *)histmap + histoff[n - 1];
     int i;
 
-    if (pid < 1)
-        return 0;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid)
-        {
-            return jobs[i].jid;
-        }
+    for (i = 0; i < len; i++)
+    {
+        if (p[i] == '\n')
+            return -1;
+        if (p[i] != (unsigned char)prefix[i])
+            return p[i] - (unsigned char)prefix[i];
+    }
     return 0;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs)
+/*
+ * do_history - Execute the builtin history command: list the history,
+ *    or its last n entries
+ */
+void do_history(char **argv)
 {
-    int i;
+    int n, total = nhist + nnew, len;
+    char *line;
 
-    for (i = 0; i < MAXJOBS; i++)
+    last_status = 0;
+    if (histfd < 0)
     {
-        if (jobs[i].pid != 0)
-        {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-            switch (jobs[i].state)
-            {
-            case BG:
-                printf("Running ");
-                break;
-            case FG:
-                printf("Foreground ");
-                break;
-            case ST:
-                printf("Stopped ");
-                break;
-            default:
-                printf("listjobs: Internal error: job[%d].state=%d ",
-                       i, jobs[i].state);
-            }
-            printf("%s", jobs[i].cmdline);
-        }
+        printf("history: not enabled\n");
+        last_status = 1;
+        return;
+    }
+    if (argv[1] != NULL && (!isdigit(argv[1][0]) || argv[2] != NULL))
+    {
+        printf("usage: history [n]\n");
+        last_status = 2;
+        return;
+    }
+    n = argv[1] != NULL ? atoi(argv[1]) : total;
+    for (n = n < total ? total - n + 1 : 1; n <= total; n++)
+    {
+        line = hist_line(n, &len);
+        printf("%6d  %.*s\n", n, len, line);
     }
 }
-/******************************
- * end job list helper routines
- ******************************/
+/***********************************
+ * end command history routines
+ ***********************************/
 
 /***********************
  * Other helper routines
@@ -747,13 +5061,34 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void)
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpf] [-R log] [-P log] [-T log] [-S file] [-c cmdline | script]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -c   run cmdline and exit with its status\n");
+    printf("   -R   record the session to a log file\n");
+    printf("   -P   replay a session log and report latencies\n");
+    printf("   -f   with -P, replay without the recorded pauses\n");
+    printf("   -T   print a session log as a trace for sdriver.pl\n");
+    printf("   -S   keep job state in a file and re-adopt jobs from it\n");
     exit(1);
 }
 
+/*
+ * status2code - Convert a wait status into a shell exit status:
+ *    the exit code, or 128 + signal number for a killed or stopped job
+ */
+int status2code(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status))
+        return 128 + WSTOPSIG(status);
+    return 1;
+}
+
 /*
  * unix_error - unix-style error routine
  */
@@ -832,6 +5167,9 @@ pid_t _fork(void)
 {
     pid_t pid;
 
+    // Whatever the shell has printed must come out before the child's
+    // output, and must not be flushed a second time by the child
+    fflush(stdout);
     if ((pid = fork()) < 0)
     {
         unix_error("Fork error");